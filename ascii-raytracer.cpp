@@ -1,12 +1,52 @@
 #include <algorithm>
+#include <arpa/inet.h>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <csignal>
 #include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
 #include <fstream>
+#include <deque>
 #include <iostream>
+#include <list>
+#include <linux/io_uring.h>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <ncurses.h>
+#include <netinet/in.h>
+#include <new>
+#include <poll.h>
+#include <random>
+#include <string>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <thread>
 #include <tuple>
+#include <ucontext.h>
+#include <unistd.h>
 #include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 struct vec3 {
   float x = 0, y = 0, z = 0;
@@ -38,22 +78,874 @@ struct Material {
 struct Sphere {
   vec3 center;
   float radius;
-  Material material;
+  uint16_t material; // index into Scene::materials
+};
+
+// The materials every scene starts with, at these indices.
+enum : uint16_t { ivory, glass, red_rubber, mirror };
+const Material preset_materials[] = {
+    {1.0, {0.9, 0.5, 0.1, 0.0}, {0.4, 0.4, 0.3}, 50.},
+    {1.5, {0.0, 0.9, 0.1, 0.8}, {0.6, 0.7, 0.8}, 125.},
+    {1.0, {1.4, 0.3, 0.0, 0.0}, {0.3, 0.1, 0.1}, 10.},
+    {1.0, {0.0, 16.0, 0.8, 0.0}, {1.0, 1.0, 1.0}, 1425.}};
+
+// Radius as a half float, rounded to nearest. Scaling by 2^-112 moves the
+// float exponent into the half range, subnormals included, so the bits only
+// need shifting. Radii beyond the half range saturate.
+uint16_t to_half(float f) {
+  f = std::min(std::abs(f), 65504.f) * 0x1p-112f;
+  uint32_t bits;
+  memcpy(&bits, &f, sizeof bits);
+  return (bits + 0xfff + ((bits >> 13) & 1)) >> 13;
+}
+
+float from_half(uint16_t half) {
+  uint32_t bits = uint32_t(half) << 13;
+  float f;
+  memcpy(&f, &bits, sizeof f);
+  return f * 0x1p112f;
+}
+
+// A sphere as the BVH stores it: the center in 65535 steps across the bounds
+// of its leaf, the radius as a half float and the material, half the size of
+// Sphere. Stored in leaf order, so a leaf is one contiguous read. Spheres
+// that move keep full precision in Bvh::dynamic instead; their radius is
+// then Bvh::dynamic_mark and the center holds their index there.
+struct PackedSphere {
+  uint16_t center[3];
+  uint16_t radius;
+  uint16_t material;
+};
+
+struct Aabb {
+  vec3 lo = {INFINITY, INFINITY, INFINITY};
+  vec3 hi = {-INFINITY, -INFINITY, -INFINITY};
+
+  void grow(const vec3& p) {
+    for (int i = 0; i < 3; i++) {
+      lo[i] = std::min(lo[i], p[i]);
+      hi[i] = std::max(hi[i], p[i]);
+    }
+  }
+  void grow(const Aabb& b) {
+    for (int i = 0; i < 3; i++) {
+      lo[i] = std::min(lo[i], b.lo[i]);
+      hi[i] = std::max(hi[i], b.hi[i]);
+    }
+  }
+  float area() const {
+    vec3 d = hi - lo;
+    return d.x < 0 ? 0 : 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+  }
+};
+
+Aabb bounds_of(const Sphere& s) {
+  vec3 r = {s.radius, s.radius, s.radius};
+  return {s.center - r, s.center + r};
+}
+
+// FNV-1a over 64-bit words instead of bytes, eight times fewer steps, with
+// a shift to carry the high bits of each word down. Calls chain by passing
+// the last result as hash.
+uint64_t fnv1a(const void* data, size_t size,
+               uint64_t hash = 14695981039346656037ull) {
+  const char* p = static_cast<const char*>(data);
+  auto mix = [&](uint64_t word) {
+    hash = (hash ^ word) * 1099511628211ull;
+    hash ^= hash >> 32;
+  };
+  for (; size >= 8; p += 8, size -= 8) {
+    uint64_t word;
+    memcpy(&word, p, sizeof word);
+    mix(word);
+  }
+  for (; size; p++, size--)
+    mix(uint8_t(*p));
+  return hash;
+}
+
+// An interior node has count 0 and its children at first and first + 1; a
+// leaf holds the spheres prims[first .. first + count).
+struct BvhNode {
+  Aabb bounds;
+  int first = 0, count = 0;
+};
+
+// Node of the 4-wide BVH that traversal runs on, one cache line each. Child
+// boxes are stored per axis and per child, so all four are tested together,
+// as multiples of 2^exponent from origin, rounded outwards to 8 bits.
+struct alignas(64) WideNode {
+  vec3 origin;
+  int8_t exponent[3];
+  uint8_t count; // children in use
+  uint8_t lo[3][4], hi[3][4];
+  int child[4]; // a wide node, or ~n for the leaf nodes[n] of the binary BVH
+
+  // 2^exponent[axis], assembled directly as IEEE bits.
+  float step(int axis) const {
+    uint32_t bits = uint32_t(exponent[axis] + 127) << 23;
+    float f;
+    memcpy(&f, &bits, sizeof f);
+    return f;
+  }
+};
+
+// Bounding volume hierarchy over the spheres of a scene, which it also
+// stores, packed. Spheres that move without changing the hierarchy are
+// unpacked a leaf at a time and handled by refitting the bounds.
+class Bvh {
+public:
+  std::vector<BvhNode> nodes; // the root first, children after parents
+  std::vector<int> prims;     // sphere indices in leaf order
+  std::vector<PackedSphere> packed; // the spheres along prims
+  std::vector<Sphere> dynamic;      // the spheres of unpacked leaves
+  // The binary tree collapsed to four children per node, for traversal.
+  // Empty if the root is a leaf.
+  std::vector<WideNode> wide;
+
+  // Builds in parallel on the OpenMP threads. The top levels split the
+  // spheres sorted along a Morton curve at the highest differing bit, which
+  // costs a binary search per node; below morton_leaf_size spheres nodes are
+  // split by binned SAH. Subtrees become tasks.
+  void build(const std::vector<Sphere>& spheres) {
+    const int n = spheres.size();
+    nodes.clear();
+    prims.clear();
+    packed.clear();
+    dynamic.clear();
+    parent.clear();
+    wide.clear();
+    wide_parent.clear();
+    wide_source.clear();
+    leaf.assign(n, 0);
+    if (!n)
+      return;
+    Aabb centroids;
+    for (const Sphere& s : spheres)
+      centroids.grow(s.center);
+    std::vector<uint64_t> keys(n);
+#pragma omp parallel for
+    for (int i = 0; i < n; i++)
+      keys[i] = uint64_t(morton(centroids, spheres[i].center)) << 32 | i;
+    std::sort(keys.begin(), keys.end());
+    prims.resize(n);
+    packed.resize(n);
+    codes.resize(n);
+    for (int i = 0; i < n; i++) {
+      prims[i] = keys[i] & 0xffffffff;
+      codes[i] = keys[i] >> 32;
+    }
+
+    nodes.resize(2 * n - 1);
+    parent.assign(2 * n - 1, -1);
+    std::atomic<int> node_count{1};
+#pragma omp parallel
+#pragma omp single
+    split(spheres.data(), &node_count, 0, 0, n, 0);
+    nodes.resize(node_count);
+    parent.resize(node_count);
+    codes.clear();
+    codes.shrink_to_fit();
+    for (int i = nodes.size() - 1; i >= 0; i--) {
+      if (nodes[i].count)
+        pack_leaf(spheres.data(), i);
+      else
+        update_bounds(i);
+    }
+    owner.assign(nodes.size(), -1);
+    if (nodes[0].count == 0)
+      collapse(0, -1);
+  }
+
+  size_t size() const { return leaf.size(); }
+
+  // Sphere i, unpacked.
+  Sphere sphere(int i) const { return unpack(slot(i), nodes[leaf[i]]); }
+
+  // Packed entry k, whose leaf is node.
+  Sphere unpack(int k, const BvhNode& node) const {
+    const PackedSphere& p = packed[k];
+    if (p.radius == dynamic_mark)
+      return dynamic[dynamic_ref(p)];
+    const vec3 lo = node.bounds.lo, step = steps(node);
+    return {{lo.x + p.center[0] * step.x, lo.y + p.center[1] * step.y,
+             lo.z + p.center[2] * step.z},
+            from_half(p.radius),
+            p.material};
+  }
+
+  // Index of sphere i in dynamic, or -1 while it is packed.
+  int dynamic_index(int i) const {
+    const PackedSphere& p = packed[slot(i)];
+    return p.radius == dynamic_mark ? dynamic_ref(p) : -1;
+  }
+
+  // Replaces sphere i, or only moves its center. Its leaf is unpacked first,
+  // which allocates, unless the leaf already was; then refit(i).
+  void set(int i, const Sphere& s) { dynamic[unpack_leaf(i)] = s; }
+  void move(int i, const vec3& center) {
+    dynamic[unpack_leaf(i)].center = center;
+  }
+
+  // Recomputes the bounds of the leaf of one sphere, which must be unpacked,
+  // and its ancestors.
+  void refit(int sphere) {
+    for (int i = leaf[sphere]; i >= 0; i = parent[i])
+      update_bounds(i);
+    for (int w = owner[leaf[sphere]]; w >= 0; w = wide_parent[w])
+      quantize(w);
+  }
+
+  // Bytes taken by the tree.
+  size_t memory() const {
+    size_t bytes = 0;
+    each_array(*this, [&](const auto& v) { bytes += v.size() * sizeof v[0]; });
+    return bytes;
+  }
+
+  // Expected cost of a ray query relative to testing one sphere, counting a
+  // node visit the same as a sphere test.
+  float sah_cost() const {
+    if (nodes.empty())
+      return 0;
+    double cost = 0;
+    for (const BvhNode& node : nodes)
+      cost += node.bounds.area() * (node.count ? node.count : 1);
+    return cost / nodes[0].bounds.area();
+  }
+
+  // Content hash of what a build depends on: the bounds of the spheres, the
+  // build parameters and the layout of the nodes. Materials are left out;
+  // load() takes them from the spheres.
+  static uint64_t key(const std::vector<Sphere>& spheres) {
+    const uint64_t params[] = {cache_version,   morton_leaf_size,
+                               min_split_size,  max_leaf_size,
+                               max_depth,       bins,
+                               sizeof(BvhNode), sizeof(WideNode),
+                               sizeof(PackedSphere)};
+    uint64_t hash = fnv1a(params, sizeof params);
+    for (const Sphere& s : spheres) {
+      const float bounds[4] = {s.center.x, s.center.y, s.center.z, s.radius};
+      hash = fnv1a(bounds, sizeof bounds, hash);
+    }
+    return hash;
+  }
+
+  // Writes the tree to path for load() under key, with the time its build
+  // took. The file appears atomically, so readers never see half of it.
+  bool save(const std::string& path, uint64_t key, float build_seconds) const {
+    CacheHeader header;
+    header.key = key;
+    header.build_seconds = build_seconds;
+    header.payload_hash = fnv1a(nullptr, 0);
+    int i = 0;
+    each_array(*this, [&](const auto& v) {
+      header.sizes[i++] = v.size();
+      header.payload_hash =
+          fnv1a(v.data(), v.size() * sizeof v[0], header.payload_hash);
+    });
+    std::string temp = path + ".tmp" + std::to_string(getpid());
+    FILE* file = fopen(temp.c_str(), "wb");
+    if (!file)
+      return false;
+    bool ok = fwrite(&header, sizeof header, 1, file) == 1;
+    each_array(*this, [&](const auto& v) { // data() may be null if empty
+      ok = ok && (v.empty() ||
+                  fwrite(v.data(), sizeof v[0], v.size(), file) == v.size());
+    });
+    ok = fclose(file) == 0 && ok;
+    ok = ok && rename(temp.c_str(), path.c_str()) == 0;
+    if (!ok)
+      unlink(temp.c_str());
+    return ok;
+  }
+
+  // Replaces the tree with the one saved at path, if that was saved under key
+  // for these spheres and is intact; sets build_seconds to what its build
+  // took. Otherwise returns false and leaves the tree alone.
+  bool load(const std::string& path, uint64_t key,
+            const std::vector<Sphere>& spheres, float& build_seconds) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    void* map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(CacheHeader))
+      map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      return false;
+    const char* data = static_cast<const char*>(map);
+    const size_t size = st.st_size;
+    CacheHeader header;
+    memcpy(&header, data, sizeof header);
+    const uint64_t* n = header.sizes;
+    bool ok = header.version == cache_version && header.key == key &&
+              !memcmp(header.magic, CacheHeader().magic, 4) &&
+              n[1] == spheres.size() && n[2] == spheres.size() &&
+              n[5] == spheres.size() && n[4] == n[0] && n[6] == n[0] &&
+              n[8] == n[7] && n[9] == n[7];
+    // The arrays must fill the rest of the file exactly and hash as saved.
+    size_t offset = sizeof header;
+    uint64_t hash = fnv1a(nullptr, 0);
+    int i = 0;
+    each_array(*this, [&](const auto& v) {
+      const uint64_t count = n[i++];
+      ok = ok && count <= (size - offset) / sizeof v[0];
+      if (ok) {
+        hash = fnv1a(data + offset, count * sizeof v[0], hash);
+        offset += count * sizeof v[0];
+      }
+    });
+    ok = ok && offset == size && hash == header.payload_hash;
+    if (ok) {
+      // Copied rather than used in place: refits modify the arrays, and the
+      // file does not keep the nodes aligned.
+      Bvh loaded;
+      offset = sizeof header;
+      i = 0;
+      each_array(loaded, [&](auto& v) {
+        v.resize(n[i++]);
+        if (!v.empty())
+          memcpy(v.data(), data + offset, v.size() * sizeof v[0]);
+        offset += v.size() * sizeof v[0];
+      });
+      // The hash only catches damage; a file written to match it could
+      // still send traversal and refits outside the arrays.
+      ok = loaded.valid(spheres.size());
+      if (ok) {
+        for (size_t k = 0; k < loaded.packed.size(); k++) {
+          PackedSphere& p = loaded.packed[k];
+          p.material = spheres[loaded.prims[k]].material;
+          if (p.radius == dynamic_mark)
+            loaded.dynamic[dynamic_ref(p)].material = p.material;
+        }
+        *this = std::move(loaded);
+        build_seconds = header.build_seconds;
+      }
+    }
+    munmap(map, size);
+    return ok;
+  }
+
+private:
+  static constexpr int morton_leaf_size = 4096; // Morton splits above this
+  static constexpr int task_size = 1024;        // subtrees above this are tasks
+  static constexpr int min_split_size = 4; // smaller ranges are always leaves
+  static constexpr int max_leaf_size = 8;
+  static constexpr int max_depth = 48; // keeps traversal stacks small
+  static constexpr int bins = 16;
+  static constexpr uint32_t cache_version = 4; // bump when the format changes
+  static constexpr uint16_t dynamic_mark = 0xffff; // a NaN, never a radius
+
+  struct CacheHeader {
+    char magic[4] = {'A', 'R', 'T', 'B'};
+    uint32_t version = cache_version;
+    uint64_t key = 0, payload_hash = 0;
+    float build_seconds = 0;
+    uint32_t unused = 0;
+    uint64_t sizes[10] = {}; // of the arrays in each_array() order
+  };
+
+  std::vector<int> parent; // of every node, -1 for the root
+  std::vector<int> leaf;   // leaf node of every sphere
+  std::vector<int> owner;  // wide node with a binary node as child, or -1
+  std::vector<int> wide_parent;                // -1 for the root
+  std::vector<std::array<int, 4>> wide_source; // binary node of each child
+  std::vector<uint32_t> codes; // Morton codes along prims, during build
+
+  // Whether every index in the tree stays inside its arrays, every sphere is
+  // in its leaf once, children come after their parents, so nothing loops,
+  // and the wide tree is no deeper than the traversal stack allows.
+  bool valid(size_t spheres) const {
+    const int n = nodes.size(), w = wide.size();
+    for (int i = 0; i < n; i++) {
+      const BvhNode& node = nodes[i];
+      if (node.count ? node.count < 0 || node.first < 0 ||
+                           node.first > int(prims.size()) - node.count
+                     : node.first <= i || node.first >= n - 1)
+        return false;
+      if (parent[i] < -1 || parent[i] >= i || owner[i] < -1 || owner[i] >= w)
+        return false;
+    }
+    for (int prim : prims)
+      if (prim < 0 || size_t(prim) >= spheres)
+        return false;
+    for (int node : leaf)
+      if (node < 0 || node >= n || !nodes[node].count)
+        return false;
+    // Then every sphere is found by slot().
+    std::vector<uint8_t> seen(spheres);
+    size_t found = 0;
+    for (int i = 0; i < n; i++)
+      for (int k = nodes[i].first; k < nodes[i].first + nodes[i].count; k++) {
+        if (leaf[prims[k]] != i || seen[prims[k]]++)
+          return false;
+        found++;
+      }
+    if (found != spheres)
+      return false;
+    for (const PackedSphere& p : packed)
+      if (p.radius == dynamic_mark &&
+          size_t(dynamic_ref(p)) >= dynamic.size())
+        return false;
+    std::vector<int> depth(w);
+    for (int i = 0; i < w; i++) {
+      const int up = wide_parent[i];
+      if (up < -1 || up >= i || wide[i].count < 1 || wide[i].count > 4)
+        return false;
+      depth[i] = up < 0 ? 1 : depth[up] + 1;
+      if (depth[i] > max_depth)
+        return false;
+      for (int k = 0; k < wide[i].count; k++) {
+        const int child = wide[i].child[k], source = wide_source[i][k];
+        if ((child >= 0 ? child <= i || child >= w : ~child >= n) ||
+            source < 0 || source >= n)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  // Calls f with each array that makes up a built tree, in file order.
+  template <class Self, class F> static void each_array(Self& bvh, F f) {
+    f(bvh.nodes);
+    f(bvh.prims);
+    f(bvh.packed);
+    f(bvh.dynamic);
+    f(bvh.parent);
+    f(bvh.leaf);
+    f(bvh.owner);
+    f(bvh.wide);
+    f(bvh.wide_parent);
+    f(bvh.wide_source);
+  }
+
+  // 30 bit Morton code of p on a 1024^3 grid over bounds.
+  static uint32_t morton(const Aabb& bounds, const vec3& p) {
+    auto spread = [](uint32_t v) { // 10 bits to every third of 30
+      v = (v * 0x00010001u) & 0xff0000ffu;
+      v = (v * 0x00000101u) & 0x0f00f00fu;
+      v = (v * 0x00000011u) & 0xc30c30c3u;
+      v = (v * 0x00000005u) & 0x49249249u;
+      return v;
+    };
+    uint32_t code = 0;
+    for (int i = 0; i < 3; i++) {
+      float extent = bounds.hi[i] - bounds.lo[i];
+      float t = extent > 0 ? (p[i] - bounds.lo[i]) / extent : 0;
+      code |= spread(std::min(1023u, uint32_t(t * 1024))) << (2 - i);
+    }
+    return code;
+  }
+
+  void make_leaf(int node, int begin, int end) {
+    nodes[node].first = begin;
+    nodes[node].count = end - begin;
+    for (int i = begin; i < end; i++)
+      leaf[prims[i]] = node;
+  }
+
+  // Builds the subtree of node over prims[begin .. end), taking new nodes
+  // from node_count. Pointers, as tasks would copy what references refer to.
+  void split(const Sphere* spheres, std::atomic<int>* node_count, int node,
+             int begin, int end, int depth) {
+    const int count = end - begin;
+    if (count <= min_split_size || depth >= max_depth)
+      return make_leaf(node, begin, end);
+    int mid = -1;
+    if (count > morton_leaf_size && codes[begin] != codes[end - 1]) {
+      // First sphere with the highest bit that differs across the range.
+      uint32_t bit = 1u << (31 - __builtin_clz(codes[begin] ^ codes[end - 1]));
+      mid = std::partition_point(
+                codes.begin() + begin, codes.begin() + end,
+                [&](uint32_t code) { return !(code & bit); }) -
+            codes.begin();
+    } else {
+      mid = sah_split(spheres, begin, end);
+      if (mid < 0)
+        return make_leaf(node, begin, end);
+    }
+
+    int left = node_count->fetch_add(2);
+    nodes[node].first = left;
+    nodes[node].count = 0;
+    parent[left] = parent[left + 1] = node;
+#pragma omp task if (count > task_size)
+    split(spheres, node_count, left, begin, mid, depth + 1);
+    split(spheres, node_count, left + 1, mid, end, depth + 1);
+  }
+
+  // Partitions prims[begin .. end) at the cheapest of the bin boundaries
+  // along the axis where the centers spread most. Returns the split point,
+  // or -1 if a leaf is cheaper.
+  int sah_split(const Sphere* spheres, int begin, int end) {
+    const int count = end - begin;
+    Aabb box, centroids;
+    for (int i = begin; i < end; i++) {
+      box.grow(bounds_of(spheres[prims[i]]));
+      centroids.grow(spheres[prims[i]].center);
+    }
+    int axis = 0;
+    vec3 extent = centroids.hi - centroids.lo;
+    for (int i = 1; i < 3; i++)
+      if (extent[i] > extent[axis])
+        axis = i;
+    if (extent[axis] <= 0) { // all centered alike: any split is as good
+      if (count <= max_leaf_size)
+        return -1;
+      return begin + count / 2;
+    }
+    const float scale = bins / extent[axis];
+    auto bin_of = [&](int prim) {
+      int b = (spheres[prim].center[axis] - centroids.lo[axis]) * scale;
+      return std::min(b, bins - 1);
+    };
+    Aabb bin_bounds[bins];
+    int bin_count[bins] = {};
+    for (int i = begin; i < end; i++) {
+      int b = bin_of(prims[i]);
+      bin_bounds[b].grow(bounds_of(spheres[prims[i]]));
+      bin_count[b]++;
+    }
+    // Cost of splitting after bin i, from a sweep from either side.
+    float right_cost[bins];
+    Aabb acc;
+    int acc_count = 0;
+    for (int i = bins - 1; i > 0; i--) {
+      acc.grow(bin_bounds[i]);
+      acc_count += bin_count[i];
+      right_cost[i - 1] = acc.area() * acc_count;
+    }
+    float best_cost = INFINITY;
+    int best = -1;
+    acc = {};
+    acc_count = 0;
+    for (int i = 0; i < bins - 1; i++) {
+      acc.grow(bin_bounds[i]);
+      acc_count += bin_count[i];
+      float cost = acc.area() * acc_count + right_cost[i];
+      if (acc_count > 0 && acc_count < count && cost < best_cost) {
+        best_cost = cost;
+        best = i;
+      }
+    }
+    // A node visit costs about as much as a sphere test.
+    if (best < 0 ||
+        (count <= max_leaf_size && 1 + best_cost / box.area() >= count))
+      return -1;
+    return std::partition(prims.begin() + begin, prims.begin() + end,
+                          [&](int prim) { return bin_of(prim) <= best; }) -
+           prims.begin();
+  }
+
+  // Makes a wide node of the binary node b: its two children, then the
+  // largest interior one of those replaced by its children until there are
+  // four, with the same done recursively below.
+  int collapse(int b, int up) {
+    std::array<int, 4> children = {nodes[b].first, nodes[b].first + 1};
+    int count = 2;
+    while (count < 4) {
+      int open = -1;
+      for (int k = 0; k < count; k++)
+        if (!nodes[children[k]].count &&
+            (open < 0 || nodes[children[k]].bounds.area() >
+                             nodes[children[open]].bounds.area()))
+          open = k;
+      if (open < 0)
+        break;
+      int first = nodes[children[open]].first;
+      children[open] = first;
+      children[count++] = first + 1;
+    }
+    const int w = wide.size();
+    wide.emplace_back();
+    wide_parent.push_back(up);
+    wide_source.push_back(children);
+    wide[w].count = count;
+    for (int k = 0; k < count; k++) {
+      owner[children[k]] = w;
+      wide[w].child[k] =
+          nodes[children[k]].count ? ~children[k] : collapse(children[k], w);
+    }
+    quantize(w);
+    return w;
+  }
+
+  // Sets the quantized child boxes of wide node w from the binary ones.
+  void quantize(int w) {
+    WideNode& node = wide[w];
+    Aabb box;
+    for (int k = 0; k < node.count; k++)
+      box.grow(nodes[wide_source[w][k]].bounds);
+    node.origin = box.lo;
+    for (int a = 0; a < 3; a++) {
+      // Smallest power of two step that spans the box in 255 steps.
+      int e;
+      std::frexp((box.hi[a] - box.lo[a]) / 255, &e);
+      e = std::max(-126, std::min(127, e));
+      node.exponent[a] = e;
+      float step = node.step(a);
+      for (int k = 0; k < 4; k++) {
+        if (k >= node.count) {
+          node.lo[a][k] = node.hi[a][k] = 0;
+          continue;
+        }
+        const Aabb& b = nodes[wide_source[w][k]].bounds;
+        // Round outwards, and make sure float arithmetic agrees.
+        int lo = std::floor((b.lo[a] - box.lo[a]) / step);
+        int hi = std::ceil((b.hi[a] - box.lo[a]) / step);
+        lo = std::max(0, std::min(255, lo));
+        hi = std::max(0, std::min(255, hi));
+        while (lo > 0 && box.lo[a] + lo * step > b.lo[a])
+          lo--;
+        while (hi < 255 && box.lo[a] + hi * step < b.hi[a])
+          hi++;
+        node.lo[a][k] = lo;
+        node.hi[a][k] = hi;
+      }
+    }
+  }
+
+  // Size of a packed center step in each axis of a leaf.
+  static vec3 steps(const BvhNode& leaf) {
+    return (leaf.bounds.hi - leaf.bounds.lo) * (1.f / 65535);
+  }
+
+  // Index in dynamic that an entry marked dynamic_mark holds.
+  static int dynamic_ref(const PackedSphere& p) {
+    return p.center[0] | p.center[1] << 16;
+  }
+
+  // Entry of sphere i in packed: a search of its leaf.
+  int slot(int i) const {
+    int k = nodes[leaf[i]].first;
+    while (prims[k] != i)
+      k++;
+    return k;
+  }
+
+  // Moves the spheres of the leaf of sphere i to dynamic, unless they are
+  // there already, and returns the index of sphere i there. The leaf keeps
+  // its bounds until refit, and they still hold the spheres.
+  int unpack_leaf(int i) {
+    const BvhNode& node = nodes[leaf[i]];
+    if (packed[node.first].radius != dynamic_mark)
+      for (int k = node.first; k < node.first + node.count; k++) {
+        const Sphere s = unpack(k, node);
+        mark_dynamic(k, s.material);
+        dynamic.push_back(s);
+      }
+    return dynamic_index(i);
+  }
+
+  void mark_dynamic(int k, uint16_t material) {
+    const uint32_t index = dynamic.size();
+    packed[k] = {{uint16_t(index), uint16_t(index >> 16), 0}, dynamic_mark,
+                 material};
+  }
+
+  // Bounds leaf i and packs its spheres into them, with room for the
+  // rounding, so the packed spheres stay inside. Leaves with radii beyond
+  // the half range stay unpacked.
+  void pack_leaf(const Sphere* spheres, int i) {
+    BvhNode& node = nodes[i];
+    node.bounds = {};
+    float radius = 0;
+    for (int k = node.first; k < node.first + node.count; k++) {
+      node.bounds.grow(bounds_of(spheres[prims[k]]));
+      radius = std::max(radius, spheres[prims[k]].radius);
+    }
+    if (!(radius <= 65504)) {
+      for (int k = node.first; k < node.first + node.count; k++) {
+        mark_dynamic(k, spheres[prims[k]].material);
+        dynamic.push_back(spheres[prims[k]]);
+      }
+      return;
+    }
+    vec3 extent = node.bounds.hi - node.bounds.lo;
+    float margin =
+        radius / 1024 + std::max({extent.x, extent.y, extent.z}) / 16384;
+    node.bounds.lo = node.bounds.lo - vec3{margin, margin, margin};
+    node.bounds.hi = node.bounds.hi + vec3{margin, margin, margin};
+    const vec3 step = steps(node);
+    for (int k = node.first; k < node.first + node.count; k++) {
+      const Sphere& s = spheres[prims[k]];
+      PackedSphere& p = packed[k];
+      for (int a = 0; a < 3; a++) {
+        long q = step[a] > 0
+                     ? std::lround((s.center[a] - node.bounds.lo[a]) / step[a])
+                     : 0;
+        p.center[a] = std::max(0L, std::min(65535L, q));
+      }
+      p.radius = to_half(s.radius);
+      p.material = s.material;
+    }
+  }
+
+  // Recomputes the bounds of node i from its children, or from its spheres
+  // if it is an unpacked leaf. Packed leaves keep theirs, which are what
+  // their spheres are packed into.
+  void update_bounds(int i) {
+    BvhNode& node = nodes[i];
+    if (node.count && packed[node.first].radius != dynamic_mark)
+      return;
+    node.bounds = {};
+    if (node.count) {
+      for (int k = node.first; k < node.first + node.count; k++)
+        node.bounds.grow(bounds_of(unpack(k, node)));
+    } else {
+      node.bounds.grow(nodes[node.first].bounds);
+      node.bounds.grow(nodes[node.first + 1].bounds);
+    }
+  }
+};
+
+// Rigid transform: the images of the unit axes, then a translation.
+struct Transform {
+  vec3 x = {1, 0, 0}, y = {0, 1, 0}, z = {0, 0, 1};
+  vec3 origin;
+
+  vec3 rotate(const vec3& v) const { return x * v.x + y * v.y + z * v.z; }
+  vec3 apply(const vec3& p) const { return rotate(p) + origin; }
+  // This transform after local, as in parent * child.
+  Transform operator*(const Transform& local) const {
+    return {rotate(local.x), rotate(local.y), rotate(local.z),
+            apply(local.origin)};
+  }
+
+  static Transform translation(const vec3& v) {
+    Transform t;
+    t.origin = v;
+    return t;
+  }
+  // Turns by radians around the y axis, positive turning x towards -z, as
+  // Camera::yaw.
+  static Transform rotation_y(float radians) {
+    Transform t;
+    t.x = {std::cos(radians), 0, -std::sin(radians)};
+    t.z = {std::sin(radians), 0, std::cos(radians)};
+    return t;
+  }
+};
+
+// Scene graph node. A sphere attached to a node is centered at the node's
+// origin, so it follows every transform above it.
+struct SceneNode {
+  int parent = -1;  // an earlier node, or -1 for the scene root
+  int sphere = -1;  // index of the attached sphere, if any
+  float spin = 0;   // degrees per frame that animate() turns local around y
+  Transform local;  // relative to the parent
+  Transform world;  // cached parent world * local
+  bool dirty = true;   // local changed since world was computed
+  bool updated = true; // world was recomputed by the last update_world()
+};
+
+struct Scene {
+  // As generated or loaded, until build_bvh() hands them to bvh; empty after.
+  std::vector<Sphere> spheres;
+  std::vector<vec3> lights;
+  std::vector<Material> materials = {std::begin(preset_materials),
+                                     std::end(preset_materials)};
+  std::vector<SceneNode> nodes; // parents come before their children
+  // Spheres moved by the last update_world(), for whoever keeps per-sphere
+  // state that has to follow them.
+  std::vector<int> moved;
+  Bvh bvh; // holds the spheres; rebuilt when spheres are added or removed
 };
 
-constexpr Material ivory = {1.0, {0.9, 0.5, 0.1, 0.0}, {0.4, 0.4, 0.3}, 50.};
-constexpr Material glass = {1.5, {0.0, 0.9, 0.1, 0.8}, {0.6, 0.7, 0.8}, 125.};
-constexpr Material red_rubber = {
-    1.0, {1.4, 0.3, 0.0, 0.0}, {0.3, 0.1, 0.1}, 10.};
-constexpr Material mirror = {
-    1.0, {0.0, 16.0, 0.8, 0.0}, {1.0, 1.0, 1.0}, 1425.};
+int add_node(Scene& scene, int parent, const Transform& local,
+             int sphere = -1, float spin = 0) {
+  SceneNode node;
+  node.parent = parent;
+  node.sphere = sphere;
+  node.spin = spin;
+  node.local = local;
+  scene.nodes.push_back(node);
+  return scene.nodes.size() - 1;
+}
+
+void set_local(Scene& scene, int node, const Transform& local) {
+  scene.nodes[node].local = local;
+  scene.nodes[node].dirty = true;
+}
+
+// Recomputes the world transforms of dirty nodes and everything below them,
+// moves the attached spheres, in the BVH once it is built, and lists them in
+// scene.moved. As parents come first one pass in order suffices; clean
+// subtrees cost a flag test per node.
+void update_world(Scene& scene) {
+  scene.moved.clear();
+  for (SceneNode& node : scene.nodes) {
+    const SceneNode* parent =
+        node.parent >= 0 ? &scene.nodes[node.parent] : nullptr;
+    node.updated = node.dirty || (parent && parent->updated);
+    node.dirty = false;
+    if (!node.updated)
+      continue;
+    node.world = parent ? parent->world * node.local : node.local;
+    if (node.sphere >= 0) {
+      if (scene.spheres.empty())
+        scene.bvh.move(node.sphere, node.world.origin);
+      else
+        scene.spheres[node.sphere].center = node.world.origin;
+      scene.moved.push_back(node.sphere);
+    }
+  }
+}
+
+// Leaves scene.spheres to scene.bvh, just built from them. The spheres in the
+// scene graph, or all of them if exact, keep full precision, as they move;
+// so do the others in their leaves, which are unpacked along with them.
+void hand_over_spheres(Scene& scene, bool exact = false) {
+  Bvh& bvh = scene.bvh;
+  for (size_t i = 0; exact && i < scene.spheres.size(); i++)
+    bvh.set(i, scene.spheres[i]);
+  for (const SceneNode& node : scene.nodes)
+    if (node.sphere >= 0)
+      bvh.set(node.sphere, scene.spheres[node.sphere]);
+  for (size_t i = 0; !bvh.dynamic.empty() && i < bvh.size(); i++)
+    if (bvh.dynamic_index(i) >= 0) {
+      bvh.set(i, scene.spheres[i]);
+      bvh.refit(i);
+    }
+  scene.spheres.clear();
+  scene.spheres.shrink_to_fit();
+}
+
+// The motion of the default scene: spheres 2 and 3 orbit pivots below them.
+void add_orbits(Scene& scene) {
+  const vec3 pivots[] = {{1.5, -2.5, -15.0}, {1.5, -2.5, -20.0}};
+  const float spins[] = {1.6, -0.8};
+  for (int i = 0; i < 2; i++) {
+    int pivot = add_node(scene, -1, Transform::translation(pivots[i]), -1,
+                         spins[i]);
+    vec3 offset = scene.spheres[2 + i].center - pivots[i];
+    add_node(scene, pivot, Transform::translation(offset), 2 + i);
+  }
+  update_world(scene);
+}
+
+// The spheres and lights of the default scene, without its motion or BVH.
+Scene default_layout() {
+  return {{{{-3, 0, -16}, 2, ivory},
+           {{-1.0, -1.5, -12}, 2, glass},
+           {{1.5, -0.5, -18}, 3, red_rubber},
+           {{7, 5, -18}, 4, mirror}},
+          {{-20, 20, 20}, {30, 50, -25}, {30, 20, 30}}};
+}
 
-Sphere spheres[] = {{{-3, 0, -16}, 2, ivory},
-                              {{-1.0, -1.5, -12}, 2, glass},
-                              {{1.5, -0.5, -18}, 3, red_rubber},
-                              {{7, 5, -18}, 4, mirror}};
+Scene default_scene() {
+  Scene scene = default_layout();
+  add_orbits(scene);
+  scene.bvh.build(scene.spheres);
+  hand_over_spheres(scene);
+  return scene;
+}
 
-constexpr vec3 lights[] = {{-20, 20, 20}, {30, 50, -25}, {30, 20, 30}};
+// Set up by main: building a BVH uses OpenMP, which must not run during
+// static initialization.
+Scene scene;
 
 vec3 reflect(const vec3& I, const vec3& N) { return I - N * 2.f * (I * N); }
 
@@ -73,6 +965,73 @@ vec3 refract(const vec3& I, const vec3& N, const float eta_t,
                                          // has no physical meaning
 }
 
+using Clock = std::chrono::steady_clock;
+
+// Counters of one thread, on a cache line of their own, which other threads
+// may read at any time; readers sum them over the threads.
+struct alignas(64) ThreadCounters {
+  std::atomic<uint64_t> rays{0}, busy_ns{0}, tiles{0};
+};
+
+constexpr int max_counted_threads = 256;
+ThreadCounters thread_counters[max_counted_threads];
+std::atomic<int> counted_threads{0};
+
+// The calling thread's view of its counters. Rays are counted in a plain
+// variable and published with the time of each tile, or every
+// publish_rays rays. A thread owning its slot publishes with relaxed
+// stores; threads past max_counted_threads share slots and add atomically.
+struct LocalCounters {
+  static constexpr uint64_t publish_rays = 1024;
+  ThreadCounters* slot;
+  bool shared;
+  uint64_t rays = 0; // not yet published
+
+  void add(std::atomic<uint64_t>& counter, uint64_t n) {
+    if (shared)
+      counter.fetch_add(n, std::memory_order_relaxed);
+    else
+      counter.store(counter.load(std::memory_order_relaxed) + n,
+                    std::memory_order_relaxed);
+  }
+  void ray() {
+    if (++rays == publish_rays)
+      publish();
+  }
+  void publish() {
+    add(slot->rays, rays);
+    rays = 0;
+  }
+  // Ends a tile that took ns.
+  void tile(uint64_t ns) {
+    add(slot->busy_ns, ns);
+    add(slot->tiles, 1);
+    publish();
+  }
+};
+
+LocalCounters& local_counters() {
+  thread_local LocalCounters counters = [] {
+    int i = counted_threads++;
+    return LocalCounters{&thread_counters[i % max_counted_threads],
+                         i >= max_counted_threads};
+  }();
+  return counters;
+}
+
+// Lets the sampling profiler of --profile record the calling thread; every
+// thread calls it first thing. Defined with the Profiler below.
+void profile_thread();
+
+// Sum of one counter over all threads.
+uint64_t total(std::atomic<uint64_t> ThreadCounters::*counter) {
+  uint64_t sum = 0;
+  int threads = std::min<int>(counted_threads, max_counted_threads);
+  for (int i = 0; i < threads; i++)
+    sum += (thread_counters[i].*counter).load(std::memory_order_relaxed);
+  return sum;
+}
+
 std::tuple<bool, float> ray_sphere_intersect(
     const vec3& orig, const vec3& dir,
     const Sphere& s) { // ret value is a pair [intersection found, distance]
@@ -91,56 +1050,242 @@ std::tuple<bool, float> ray_sphere_intersect(
   return {false, 0};
 }
 
-std::tuple<bool, vec3, vec3, Material> scene_intersect(const vec3& orig,
-                                                       const vec3& dir) {
-  vec3 pt, N;
-  Material material;
+// Four lanes for testing the children of a wide node together, with the
+// GCC/Clang vector extensions, which map onto SSE, NEON and the like.
+typedef float float4 __attribute__((vector_size(16)));
+typedef uint8_t byte4 __attribute__((vector_size(4)));
+
+float4 min(float4 a, float4 b) { return a < b ? a : b; }
+float4 max(float4 a, float4 b) { return a < b ? b : a; }
+
+// Four bytes as floats. Compilers convert byte lanes one at a time, so on
+// x86 they are interleaved with zeros into 32-bit lanes first.
+float4 widen(const uint8_t* bytes) {
+#ifdef __SSE2__
+  int32_t word;
+  memcpy(&word, bytes, sizeof word);
+  __m128i zero = _mm_setzero_si128(), v = _mm_cvtsi32_si128(word);
+  v = _mm_unpacklo_epi16(_mm_unpacklo_epi8(v, zero), zero);
+  return (float4)_mm_cvtepi32_ps(v);
+#else
+  byte4 v;
+  memcpy(&v, bytes, sizeof v);
+  return __builtin_convertvector(v, float4);
+#endif
+}
 
-  float nearest_dist = 1e10;
-  if (std::abs(dir.y) >
-      .001) { // intersect the ray with the checkerboard, avoid division by zero
-    float d =
-        -(orig.y + 4) / dir.y; // the checkerboard plane has equation y = -4
-    vec3 p = orig + dir * d;
-    if (d > .001 && d < nearest_dist && std::abs(p.x) < 10 && p.z < -10 &&
-        p.z > -30) {
-      nearest_dist = d;
-      pt = p;
-      N = {0, 1, 0};
-      material.diffuse_color = (int(.5 * pt.x + 1000) + int(.5 * pt.z)) & 1
-                                   ? vec3{.3, .3, .3}
-                                   : vec3{.3, .2, .1};
+// Calls visit(index, sphere) for the spheres whose leaves the ray enters
+// before tmax, nearer subtrees first, unpacking them on the way. visit may
+// lower tmax to prune farther nodes, and returns true to end the traversal.
+template <class Visit>
+void traverse(const Bvh& bvh, const vec3& orig, const vec3& dir, float& tmax,
+              Visit visit) {
+  auto visit_leaf = [&](const BvhNode& leaf) {
+    for (int i = leaf.first; i < leaf.first + leaf.count; i++)
+      if (visit(bvh.prims[i], bvh.unpack(i, leaf)))
+        return true;
+    return false;
+  };
+  if (bvh.wide.empty()) { // small scenes: a box test costs more than it saves
+    if (!bvh.nodes.empty())
+      visit_leaf(bvh.nodes[0]);
+    return;
+  }
+  // Huge rather than infinite where the ray is parallel to an axis, which
+  // keeps 0 * inv_dir finite below.
+  vec3 inv_dir;
+  for (int a = 0; a < 3; a++)
+    inv_dir[a] = dir[a] ? 1 / dir[a] : std::copysign(1e30f, dir[a]);
+  struct Entry {
+    int ref; // as WideNode::child
+    float t;
+  } stack[3 * 48 + 1]; // up to three children pushed per level
+  int top = 0;
+  stack[top++] = {0, 0};
+  while (top) {
+    Entry entry = stack[--top];
+    if (entry.t > tmax)
+      continue; // a nearer hit was found after this was pushed
+    if (entry.ref < 0) {
+      if (visit_leaf(bvh.nodes[~entry.ref]))
+        return;
+      continue;
+    }
+    // Slab tests of all four children at once.
+    const WideNode& node = bvh.wide[entry.ref];
+    float4 t0 = {0, 0, 0, 0}, t1 = {tmax, tmax, tmax, tmax};
+    for (int a = 0; a < 3; a++) {
+      // Box plane q of a child is hit at t = base + q * scale.
+      const float base = (node.origin[a] - orig[a]) * inv_dir[a];
+      const float scale = node.step(a) * inv_dir[a];
+      float4 near = base + widen(node.lo[a]) * scale;
+      float4 far = base + widen(node.hi[a]) * scale;
+      t0 = max(t0, min(near, far));
+      t1 = min(t1, max(near, far));
+    }
+    // Sort the children by distance, misses last, with a branch-free sorting
+    // network on keys of the distance bits above the child slot; distances
+    // are not negative, so their bits order like the numbers. Then push the
+    // hits farthest first so the nearest is popped next.
+    uint64_t keys[4];
+    for (int k = 0; k < 4; k++) {
+      float t = k < node.count && t0[k] <= t1[k] ? t0[k] : INFINITY;
+      uint32_t bits;
+      memcpy(&bits, &t, sizeof bits);
+      keys[k] = uint64_t(bits) << 32 | k;
+    }
+    auto order = [&](int i, int j) {
+      uint64_t a = keys[i], b = keys[j];
+      keys[i] = std::min(a, b);
+      keys[j] = std::max(a, b);
+    };
+    order(0, 1);
+    order(2, 3);
+    order(0, 2);
+    order(1, 3);
+    order(1, 2);
+    for (int k = 3; k >= 0; k--) {
+      uint32_t bits = keys[k] >> 32;
+      float t;
+      memcpy(&t, &bits, sizeof t);
+      if (t < INFINITY)
+        stack[top++] = {node.child[keys[k] & 3], t};
     }
   }
+}
+
+// Material of an object id at a point on its surface.
+Material material_of(const Scene& scene, int object, const vec3& point) {
+  if (object >= 0)
+    return scene.materials[scene.bvh.sphere(object).material];
+  Material checkerboard;
+  bool odd = (int(.5 * point.x + 1000) + int(.5 * point.z)) & 1;
+  checkerboard.diffuse_color = odd ? vec3{.3, .3, .3} : vec3{.3, .2, .1};
+  return checkerboard;
+}
+
+// Distance along the ray to the checkerboard, the plane y = -4 within
+// |x| < 10 and -30 < z < -10, or infinity if the ray misses it.
+float checkerboard_distance(const vec3& orig, const vec3& dir) {
+  if (std::abs(dir.y) <= .001) // nearly parallel, avoid division by zero
+    return INFINITY;
+  float d = -(orig.y + 4) / dir.y;
+  vec3 p = orig + dir * d;
+  return d > .001 && std::abs(p.x) < 10 && p.z < -10 && p.z > -30 ? d
+                                                                   : INFINITY;
+}
+
+constexpr int background = -2; // object id of pixels that hit nothing
 
-  for (const Sphere& s : spheres) { // intersect the ray with all spheres
+// Nearest surface along the ray before tmax: the sphere index, -1 for the
+// checkerboard or background for none. Lowers tmax to the distance of the
+// hit, so the traversal prunes everything beyond it, and sets normal to the
+// normal there.
+int nearest_hit(const Scene& scene, const vec3& orig, const vec3& dir,
+                float& tmax, vec3& normal) {
+  int object = background;
+  float board = checkerboard_distance(orig, dir);
+  if (board < tmax) {
+    tmax = board;
+    object = -1;
+  }
+  vec3 center;
+  traverse(scene.bvh, orig, dir, tmax, [&](int i, const Sphere& s) {
     auto [intersection, d] = ray_sphere_intersect(orig, dir, s);
-    if (!intersection || d > nearest_dist)
+    if (intersection && d < tmax) {
+      tmax = d;
+      object = i;
+      center = s.center;
+    }
+    return false;
+  });
+  normal = object >= 0 ? (orig + dir * tmax - center).normalized()
+                       : vec3{0, 1, 0};
+  return object;
+}
+
+// ret value is [hit, point, normal, material, object], where object is the
+// sphere index or -1 for the checkerboard
+std::tuple<bool, vec3, vec3, Material, int>
+scene_intersect(const Scene& scene, const vec3& orig, const vec3& dir) {
+  local_counters().ray();
+  float t = 1000; // anything farther counts as a miss
+  vec3 normal;
+  int object = nearest_hit(scene, orig, dir, t, normal);
+  if (object == background)
+    return {false, {}, {}, {}, -1};
+  vec3 pt = orig + dir * t;
+  return {true, pt, normal, material_of(scene, object, pt), object};
+}
+
+// Nearest surface along a query ray. object is background if nothing is hit
+// before tmax, and the other fields are then undefined.
+struct RayHit {
+  float t;
+  int object;
+  vec3 point, normal;
+};
+
+// Ray queries for callers that want hits rather than pictures, such as
+// picking or line of sight checks. Directions must be unit length, so t is a
+// distance. Rays are split across the render threads in contiguous chunks.
+void intersect_batch(const Scene& scene, size_t n, const vec3* origins,
+                     const vec3* dirs, const float* tmax, RayHit* hits) {
+#pragma omp parallel for schedule(static, 256)
+  for (size_t i = 0; i < n; i++) {
+    local_counters().ray();
+    float t = tmax[i];
+    vec3 normal;
+    int object = nearest_hit(scene, origins[i], dirs[i], t, normal);
+    if (object == background) {
+      hits[i] = {tmax[i], background, {}, {}};
       continue;
-    nearest_dist = d;
-    pt = orig + dir * nearest_dist;
-    N = (pt - s.center).normalized();
-    material = s.material;
+    }
+    hits[i] = {t, object, origins[i] + dirs[i] * t, normal};
   }
-  return {nearest_dist < 1000, pt, N, material};
 }
 
-vec3 cast_ray(const vec3& orig, const vec3& dir, const int depth = 0) {
-  auto [hit, point, N, material] = scene_intersect(orig, dir);
-  if (depth > 4 || !hit)
-    return {0.2, 0.7, 0.8}; // background color
+// Whether anything lies on the segment from origins[i] to
+// origins[i] + dirs[i] * tmax[i]. Cheaper than intersect_batch, as each ray
+// stops at the first blocker instead of looking for the nearest one.
+void occluded_batch(const Scene& scene, size_t n, const vec3* origins,
+                    const vec3* dirs, const float* tmax, uint8_t* occluded) {
+#pragma omp parallel for schedule(static, 256)
+  for (size_t i = 0; i < n; i++) {
+    const vec3& orig = origins[i];
+    const vec3& dir = dirs[i];
+    local_counters().ray();
+    bool blocked = checkerboard_distance(orig, dir) < tmax[i];
+    float t = tmax[i];
+    if (!blocked)
+      traverse(scene.bvh, orig, dir, t, [&](int, const Sphere& s) {
+        auto [intersection, d] = ray_sphere_intersect(orig, dir, s);
+        return blocked = intersection && d < tmax[i];
+      });
+    occluded[i] = blocked;
+  }
+}
+
+constexpr vec3 background_color = {0.2, 0.7, 0.8};
 
+vec3 cast_ray(const Scene& scene, const vec3& orig, const vec3& dir,
+              const int depth = 0);
+
+// Color leaving point towards -dir, for a ray of the given recursion depth
+// that hit a surface with normal N.
+vec3 shade(const Scene& scene, const vec3& point, const vec3& N,
+           const Material& material, const vec3& dir, const int depth) {
   vec3 reflect_dir = reflect(dir, N).normalized();
   vec3 refract_dir = refract(dir, N, material.refractive_index).normalized();
-  vec3 reflect_color = cast_ray(point, reflect_dir, depth + 1);
-  vec3 refract_color = cast_ray(point, refract_dir, depth + 1);
+  vec3 reflect_color = cast_ray(scene, point, reflect_dir, depth + 1);
+  vec3 refract_color = cast_ray(scene, point, refract_dir, depth + 1);
 
   float diffuse_light_intensity = 0, specular_light_intensity = 0;
   for (const vec3& light :
-       lights) { // checking if the point lies in the shadow of the light
+       scene.lights) { // checking if the point lies in the shadow of the light
     vec3 light_dir = (light - point).normalized();
-    auto [hit, shadow_pt, trashnrm, trashmat] =
-        scene_intersect(point, light_dir);
+    auto [hit, shadow_pt, trashnrm, trashmat, trashobj] =
+        scene_intersect(scene, point, light_dir);
     if (hit && (shadow_pt - point).norm() < (light - point).norm())
       continue;
     diffuse_light_intensity += std::max(0.f, light_dir * N);
@@ -154,105 +1299,3146 @@ vec3 cast_ray(const vec3& orig, const vec3& dir, const int depth = 0) {
          refract_color * material.albedo[3];
 }
 
-void print_colored_square(float r, float g, float b) {
-  int color_index =
-      16 + (36 * (int)(r * 5)) + (6 * (int)(g * 5)) + (int)(b * 5);
-  attron(COLOR_PAIR(color_index));
-  printw("⬛");
-  attroff(COLOR_PAIR(color_index));
+vec3 cast_ray(const Scene& scene, const vec3& orig, const vec3& dir,
+              const int depth) {
+  auto [hit, point, N, material, object] = scene_intersect(scene, orig, dir);
+  if (depth > 4 || !hit)
+    return background_color;
+  return shade(scene, point, N, material, dir, depth);
 }
 
-void render(int width, int height) {
-  constexpr float fov = 1.05; // 60 degrees field of view in radians
-  std::vector<vec3> framebuffer(width * height);
+// sRGB value in 0..255 of an xterm-256 color: the 6x6x6 cube from 16 to
+// 231, then a 24 step gray ramp.
+vec3 xterm_color(int index) {
+  if (index >= 232) {
+    float v = 8 + 10 * (index - 232);
+    return {v, v, v};
+  }
+  constexpr float levels[6] = {0, 95, 135, 175, 215, 255};
+  index -= 16;
+  return {levels[index / 36], levels[index / 6 % 6], levels[index % 6]};
+}
 
-#pragma omp parallel for collapse(2)
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      int pix = y * width + x;
-      float dir_x = (x + 0.5) - width / 2.0;
-      float dir_y = -(y + 0.5) + height / 2.0;
-      float dir_z = -height / (2.0 * tan(fov / 2.0));
-      framebuffer[pix] =
-          cast_ray(vec3{0, 0, 0}, vec3{dir_x, dir_y, dir_z}.normalized());
+// CIELAB (D65) of an sRGB color in 0..1, where euclidean distance roughly
+// matches perceived difference.
+vec3 srgb_to_lab(const vec3& srgb) {
+  auto linear = [](float c) {
+    return c <= .04045f ? c / 12.92f : std::pow((c + .055f) / 1.055f, 2.4f);
+  };
+  vec3 c = {linear(srgb.x), linear(srgb.y), linear(srgb.z)};
+  vec3 xyz = {(.4124f * c.x + .3576f * c.y + .1805f * c.z) / .95047f,
+              .2126f * c.x + .7152f * c.y + .0722f * c.z,
+              (.0193f * c.x + .1192f * c.y + .9505f * c.z) / 1.08883f};
+  auto f = [](float t) {
+    return t > .008856f ? std::cbrt(t) : 7.787f * t + 16.f / 116;
+  };
+  return {116 * f(xyz.y) - 16, 500 * (f(xyz.x) - f(xyz.y)),
+          200 * (f(xyz.y) - f(xyz.z))};
+}
+
+// Nearest xterm-256 color of every clamped RGB value, at lut_size levels per
+// channel.
+constexpr int lut_size = 32;
+std::array<unsigned char, lut_size * lut_size * lut_size> palette_lut;
+
+void build_palette_lut() {
+  vec3 palette[240];
+  for (int i = 16; i < 256; i++)
+    palette[i - 16] = srgb_to_lab(xterm_color(i) * (1.f / 255));
+#pragma omp parallel for
+  for (int cell = 0; cell < (int)palette_lut.size(); cell++) {
+    vec3 lab = srgb_to_lab(vec3{float(cell / (lut_size * lut_size)),
+                                float(cell / lut_size % lut_size),
+                                float(cell % lut_size)} *
+                           (1.f / (lut_size - 1)));
+    int best = 0;
+    for (int i = 1; i < 240; i++)
+      if ((palette[i] - lab) * (palette[i] - lab) <
+          (palette[best] - lab) * (palette[best] - lab))
+        best = i;
+    palette_lut[cell] = 16 + best;
+  }
+}
+
+// Amplitude of the ordered dither, about one step of the color cube when
+// enabled.
+float dither = 0;
+
+// 4x4 Bayer matrix.
+constexpr float bayer4[16] = {0,  8, 2,  10, 12, 4, 14, 6,
+                              3, 11, 1,  9,  15, 7, 13, 5};
+
+// Palette index of the color at pixel (x, y). Channels are clamped, so the
+// overbright highlights of the mirror saturate instead of wrapping around.
+int quantize(const vec3& c, int x, int y) {
+  float d = dither * ((bayer4[(y & 3) * 4 + (x & 3)] + .5f) / 16 - .5f);
+  auto level = [d](float v) {
+    return int(std::min(std::max(v + d, 0.f), 1.f) * (lut_size - 1) + .5f);
+  };
+  return palette_lut[(level(c.x) * lut_size + level(c.y)) * lut_size +
+                     level(c.z)];
+}
+
+// Escape sequence that selects each palette index as the foreground color.
+struct Sgr {
+  char bytes[12];
+  unsigned char size;
+};
+std::array<Sgr, 256> sgr_table;
+
+void build_sgr_table() {
+  for (int i = 0; i < 256; i++)
+    sgr_table[i].size = snprintf(sgr_table[i].bytes, sizeof(Sgr::bytes),
+                                 "\x1b[38;5;%dm", i);
+}
+
+// Set once the render loop reaches steady state with --check-alloc. From then
+// on any call to the global operator new is a bug and ends the run.
+std::atomic<bool> forbid_allocations{false};
+// Set by helper threads that are off the render path and may allocate.
+thread_local bool may_allocate = false;
+
+void check_allocation(size_t size) {
+  if (forbid_allocations.load(std::memory_order_relaxed) && !may_allocate) {
+    forbid_allocations = false;
+    fprintf(stderr, "operator new(%zu) in the steady-state loop\n", size);
+    std::abort();
+  }
+}
+
+// The array and nothrow forms forward to these. All of them are kept out of
+// line: once inlined, GCC would pair a malloc() with a delete expression, or
+// a free() with a new expression, and warn about a mismatch.
+__attribute__((noinline)) void* operator new(size_t size) {
+  check_allocation(size);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void* operator new(size_t size,
+                                             std::align_val_t align) {
+  check_allocation(size);
+  const size_t a = static_cast<size_t>(align);
+  // aligned_alloc takes whole multiples of the alignment only
+  if (void* p = std::aligned_alloc(a, (std::max<size_t>(size, 1) + a - 1) &
+                                          ~(a - 1)))
+    return p;
+  throw std::bad_alloc();
+}
+
+__attribute__((noinline)) void operator delete(void* p) noexcept {
+  std::free(p);
+}
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept {
+  std::free(p);
+}
+__attribute__((noinline)) void operator delete(void* p,
+                                               std::align_val_t) noexcept {
+  std::free(p);
+}
+__attribute__((noinline)) void
+operator delete(void* p, size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+// Bump allocator for data that only lives until the current frame is on
+// screen. Every thread allocates from its own arena, and all arenas are
+// rewound together at the frame barrier. Blocks are kept across frames, so
+// once the arenas have grown to a frame's needs they never call malloc again.
+class FrameArena {
+public:
+  static FrameArena& local() {
+    thread_local FrameArena* arena = [] {
+      std::lock_guard<std::mutex> lock(registry_mutex);
+      registry().push_back(std::make_unique<FrameArena>());
+      return registry().back().get();
+    }();
+    return *arena;
+  }
+
+  // Only call between frames, when no thread holds arena memory.
+  static void reset_all() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto& arena : registry()) {
+      arena->block = 0;
+      arena->used = 0;
     }
   }
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      int pix = y * width + x;
-      vec3 c = framebuffer[pix];
-      print_colored_square(c.x, c.y, c.z);
+  void* allocate(size_t bytes, size_t align) {
+    while (true) {
+      if (block < blocks.size()) {
+        size_t offset = (used + align - 1) & ~(align - 1);
+        if (offset + bytes <= blocks[block].size) {
+          used = offset + bytes;
+          return blocks[block].data.get() + offset;
+        }
+        if (++block < blocks.size()) {
+          used = 0;
+          continue;
+        }
+      }
+      size_t size = std::max<size_t>(bytes + align, 1 << 16);
+      blocks.push_back({std::make_unique<char[]>(size), size});
+      block = blocks.size() - 1;
+      used = 0;
     }
-    printw("\n");
   }
-  refresh();
-  move(0, 0);
+
+private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+  std::vector<Block> blocks;
+  size_t block = 0, used = 0;
+
+  static inline std::mutex registry_mutex;
+  static std::vector<std::unique_ptr<FrameArena>>& registry() {
+    static std::vector<std::unique_ptr<FrameArena>> arenas;
+    return arenas;
+  }
+};
+
+template <class T> struct FrameAllocator {
+  using value_type = T;
+  FrameAllocator() = default;
+  template <class U> FrameAllocator(const FrameAllocator<U>&) {}
+  T* allocate(size_t n) {
+    return static_cast<T*>(
+        FrameArena::local().allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T*, size_t) {} // freed wholesale by FrameArena::reset_all
+  template <class U> bool operator==(const FrameAllocator<U>&) const {
+    return true;
+  }
+  template <class U> bool operator!=(const FrameAllocator<U>&) const {
+    return false;
+  }
+};
+
+// For per-frame scratch containers; must not outlive the frame.
+template <class T> using frame_vector = std::vector<T, FrameAllocator<T>>;
+
+constexpr float fov = 1.05; // 60 degrees field of view in radians
+
+struct Camera {
+  vec3 position;
+  float yaw = 0;   // radians around the y axis, positive turns left
+  float pitch = 0; // radians around the local x axis, positive looks up
+
+  vec3 to_world(vec3 v) const {
+    if (pitch)
+      v = {v.x, v.y * std::cos(pitch) - v.z * std::sin(pitch),
+           v.y * std::sin(pitch) + v.z * std::cos(pitch)};
+    return {v.x * std::cos(yaw) + v.z * std::sin(yaw), v.y,
+            -v.x * std::sin(yaw) + v.z * std::cos(yaw)};
+  }
+  vec3 to_camera(const vec3& v) const {
+    vec3 c = {v.x * std::cos(yaw) - v.z * std::sin(yaw), v.y,
+              v.x * std::sin(yaw) + v.z * std::cos(yaw)};
+    if (pitch)
+      c = {c.x, c.y * std::cos(pitch) + c.z * std::sin(pitch),
+           -c.y * std::sin(pitch) + c.z * std::cos(pitch)};
+    return c;
+  }
+};
+
+// The camera looks down its local -z axis.
+vec3 primary_dir(const Camera& cam, int x, int y, int width, int height) {
+  float dir_x = (x + 0.5) - width / 2.0;
+  float dir_y = -(y + 0.5) + height / 2.0;
+  float dir_z = -height / (2.0 * tan(fov / 2.0));
+  return cam.to_world(vec3{dir_x, dir_y, dir_z}.normalized());
+}
+
+// Inverse of primary_dir: continuous pixel coordinates of a world-space point
+// in front of the camera.
+bool project(const Camera& cam, const vec3& world, int width, int height,
+             float& x, float& y) {
+  vec3 p = cam.to_camera(world - cam.position);
+  if (p.z > -.001)
+    return false;
+  float focal = height / (2.0 * tan(fov / 2.0));
+  x = p.x / -p.z * focal + width / 2.0 - 0.5;
+  y = height / 2.0 - p.y / -p.z * focal - 0.5;
+  return true;
+}
+
+struct Tile {
+  int x0, y0, x1, y1;
+};
+
+constexpr int tile_size = 8;
+
+// Tiles sorted by distance from the image center, so the region the viewer is
+// looking at is done first.
+std::vector<Tile> center_first_tiles(int width, int height) {
+  std::vector<Tile> tiles;
+  for (int y = 0; y < height; y += tile_size)
+    for (int x = 0; x < width; x += tile_size)
+      tiles.push_back({x, y, std::min(x + tile_size, width),
+                       std::min(y + tile_size, height)});
+  auto dist = [&](const Tile& t) {
+    float dx = t.x0 + t.x1 - width, dy = t.y0 + t.y1 - height;
+    return dx * dx + dy * dy;
+  };
+  std::stable_sort(tiles.begin(), tiles.end(),
+                   [&](const Tile& a, const Tile& b) {
+                     return dist(a) < dist(b);
+                   });
+  return tiles;
 }
 
-vec3 rotate(vec3 point, vec3 pivot, float angleX, float angleY, float angleZ) {
-    // Convert angles from degrees to radians
-    float radX = angleX * M_PI / 180.0;
-    float radY = angleY * M_PI / 180.0;
-    float radZ = angleZ * M_PI / 180.0;
+// Render loop state for the metrics endpoint. The loop publishes with relaxed
+// stores; the endpoint reads whatever is current, without locks.
+struct Metrics {
+  std::atomic<uint64_t> frames{0}, cancelled{0}, dropped{0};
+  std::atomic<uint64_t> output_bytes{0}, output_pending{0};
+  // Tiles handed to trace() so far. Those not yet started are this less the
+  // tiles the threads counted, which the endpoint works out when scraped.
+  std::atomic<uint64_t> tiles_planned{0};
+  std::atomic<uint64_t> scene_reloads{0}, scene_reload_errors{0};
+  std::atomic<uint64_t> scene_objects_updated{0};
+  std::atomic<uint64_t> bvh_cache_hits{0}, bvh_cache_misses{0};
+  std::atomic<uint64_t> bvh_cache_errors{0};
+  std::atomic<float> bvh_seconds_saved{0};
+  std::atomic<float> frame_seconds{0};
+} metrics;
 
-    // Translate point to origin
-    float px = point.x - pivot.x;
-    float py = point.y - pivot.y;
-    float pz = point.z - pivot.z;
+// Bumped by the input thread whenever the camera changes. A frame traced for
+// an older generation is stale and abandoned between tiles.
+std::atomic<unsigned> frame_generation{0};
+std::atomic<bool> running{true};
+std::mutex camera_mutex;
+Camera camera;
 
-    // Rotation around X-axis
-    float y1 = py * cos(radX) - pz * sin(radX);
-    float z1 = py * sin(radX) + pz * cos(radX);
-    py = y1;
-    pz = z1;
+// Split screen: every view shows the scene through its own camera, derived
+// from the interactive one. The first view fills the left half of the image,
+// the others share the right half from top to bottom.
+enum class ViewKind { main, top, side };
+std::vector<ViewKind> view_layout = {ViewKind::main};
 
-    // Rotation around Y-axis
-    float x2 = px * cos(radY) + pz * sin(radY);
-    float z2 = -px * sin(radY) + pz * cos(radY);
-    px = x2;
-    pz = z2;
+constexpr float view_focus = 16; // how far ahead the top and side views look
+constexpr float view_height = 24; // of the top view above that point
 
-    // Rotation around Z-axis
-    float x3 = px * cos(radZ) - py * sin(radZ);
-    float y3 = px * sin(radZ) + py * cos(radZ);
-    px = x3;
-    py = y3;
+struct View {
+  int x0, y0, x1, y1;
+  ViewKind kind;
+};
+
+// Parses a --views list like "main,top,side".
+bool parse_views(const std::string& list) {
+  std::vector<ViewKind> layout;
+  for (size_t begin = 0, end; begin <= list.size(); begin = end + 1) {
+    end = std::min(list.find(',', begin), list.size());
+    std::string name = list.substr(begin, end - begin);
+    if (name == "main")
+      layout.push_back(ViewKind::main);
+    else if (name == "top")
+      layout.push_back(ViewKind::top);
+    else if (name == "side")
+      layout.push_back(ViewKind::side);
+    else
+      return false;
+  }
+  if (layout.empty() || layout.size() > 4)
+    return false;
+  view_layout = layout;
+  return true;
+}
 
-    // Translate back
-    return {px + pivot.x, py + pivot.y, pz + pivot.z};
+std::vector<View> layout_views(int width, int height) {
+  const int n = view_layout.size();
+  if (n == 1)
+    return {{0, 0, width, height, view_layout[0]}};
+  std::vector<View> views = {{0, 0, width / 2, height, view_layout[0]}};
+  for (int i = 1; i < n; i++)
+    views.push_back({width / 2, height * (i - 1) / (n - 1), width,
+                     height * i / (n - 1), view_layout[i]});
+  return views;
 }
 
-void animate() {
-  spheres[3].center = rotate(spheres[3].center, {1.5, -2.5, -20.0}, 0, -0.8, 0.0);
-  spheres[2].center = rotate(spheres[2].center, {1.5, -2.5, -15.0}, 0, 1.6, 0.0);
+// The top view looks straight down on the point view_focus ahead, with the
+// viewing direction up; the side view looks at it from the right.
+Camera view_camera(const Camera& cam, ViewKind kind) {
+  if (kind == ViewKind::main)
+    return cam;
+  vec3 ahead = cam.to_world({0, 0, -1}), right = cam.to_world({1, 0, 0});
+  ahead.y = right.y = 0;
+  vec3 focus = cam.position + ahead.normalized() * view_focus;
+  Camera view;
+  if (kind == ViewKind::top) {
+    view.position = focus + vec3{0, view_height, 0};
+    view.yaw = cam.yaw;
+    view.pitch = -M_PI / 2;
+  } else {
+    view.position = focus + right.normalized() * view_focus;
+    view.yaw = cam.yaw + M_PI / 2;
+  }
+  return view;
 }
 
-int main() {
+struct Frame {
+  int width = 0, height = 0;
+  const Scene* scene = &::scene;
+  Camera camera; // set with set_camera()
+  std::array<Camera, 4> cameras; // of each view, derived from camera
+  unsigned generation = 0;
+  std::vector<View> views; // cover the image
+  std::vector<uint8_t> view_index; // into views, of every pixel
+  std::vector<Tile> tiles; // of all views, in one pass
+  std::vector<int> order; // pixel indices, tile by tile from the center out
+  int shaded = 0; // pixels of order, from the start, the last trace shaded
+  std::vector<vec3> centers; // of the unpacked spheres at trace time
+  std::vector<vec3> color;
+  std::vector<float> depth; // distance to the primary hit, inf for background
+  std::vector<int> object;  // sphere index, -1 checkerboard, background
+  std::vector<vec3> point;  // world-space primary hit
+  std::vector<vec3> normal; // surface normal at the primary hit
+  std::vector<vec3> view;   // primary ray direction
+  std::vector<float> motion_x, motion_y; // pixels moved since the last trace
 
-  constexpr int width = 80;
-  constexpr int height = 40;
+  void resize(int w, int h) {
+    if (w != width || h != height) {
+      views = layout_views(w, h);
+      view_index.resize(w * h);
+      for (int i = 0; i < (int)views.size(); i++)
+        for (int y = views[i].y0; y < views[i].y1; y++)
+          std::fill_n(&view_index[y * w + views[i].x0],
+                      views[i].x1 - views[i].x0, i);
+      tiles.clear();
+      for (const View& v : views)
+        for (Tile t : center_first_tiles(v.x1 - v.x0, v.y1 - v.y0))
+          tiles.push_back({v.x0 + t.x0, v.y0 + t.y0, v.x0 + t.x1,
+                           v.y0 + t.y1});
+      order.clear();
+      for (const Tile& t : tiles)
+        for (int y = t.y0; y < t.y1; y++)
+          for (int x = t.x0; x < t.x1; x++)
+            order.push_back(y * w + x);
+    }
+    width = w;
+    height = h;
+    color.resize(w * h);
+    depth.resize(w * h);
+    object.resize(w * h);
+    point.resize(w * h);
+    normal.resize(w * h);
+    view.resize(w * h);
+    motion_x.resize(w * h);
+    motion_y.resize(w * h);
+  }
 
-  setlocale(LC_CTYPE, "");
-  initscr();
-  noecho();
-  start_color();
-  for (int i = 16; i < 232; i++) {
-    init_pair(i, i, COLOR_BLACK);
+  int view_at(int x, int y) const { return view_index[y * width + x]; }
+
+  // Views are laid out in view_layout order at every size, so their cameras
+  // only change with camera.
+  void set_camera(const Camera& c) {
+    camera = c;
+    for (size_t i = 0; i < view_layout.size(); i++)
+      cameras[i] = view_camera(c, view_layout[i]);
   }
+};
 
-  const std::chrono::milliseconds frameDuration(1000 / 30);
-  while (true) {
-    auto start = std::chrono::steady_clock::now();
-    animate();
-    render(width, height);
-    auto end = std::chrono::steady_clock::now();
-    auto renderDuration =
-        std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-    if (renderDuration < frameDuration) {
-      std::this_thread::sleep_for(frameDuration - renderDuration);
+// Picks up the latest camera for the next frame.
+void sync_camera(Frame& frame) {
+  std::lock_guard<std::mutex> lock(camera_mutex);
+  frame.set_camera(camera);
+  frame.generation = frame_generation;
+}
+
+// Visibility: writes the primary hit of a pixel into the G-buffer.
+void visibility(Frame& frame, int x, int y) {
+  int pix = y * frame.width + x;
+  const int view = frame.view_at(x, y);
+  const View& v = frame.views[view];
+  const Camera& cam = frame.cameras[view];
+  vec3 dir = primary_dir(cam, x - v.x0, y - v.y0, v.x1 - v.x0, v.y1 - v.y0);
+  auto [hit, point, N, material, object] =
+      scene_intersect(*frame.scene, cam.position, dir);
+  frame.view[pix] = dir;
+  frame.object[pix] = hit ? object : background;
+  frame.point[pix] = point;
+  frame.normal[pix] = N;
+  frame.depth[pix] = hit ? (point - cam.position).norm() : INFINITY;
+}
+
+// Shading: colors a pixel from its G-buffer entry alone.
+void shade_pixel(Frame& frame, int pix) {
+  int obj = frame.object[pix];
+  frame.color[pix] =
+      obj == background
+          ? background_color
+          : shade(*frame.scene, frame.point[pix], frame.normal[pix],
+                  material_of(*frame.scene, obj, frame.point[pix]),
+                  frame.view[pix], 0);
+}
+
+void trace_pixel(Frame& frame, int x, int y) {
+  visibility(frame, x, y);
+  shade_pixel(frame, y * frame.width + x);
+}
+
+// Returns false if the camera moved before the frame was done.
+bool trace(Frame& frame) {
+  // Packed spheres never move, so only the others need their centers kept.
+  const std::vector<Sphere>& spheres = frame.scene->bvh.dynamic;
+  frame.centers.resize(spheres.size());
+  for (size_t i = 0; i < frame.centers.size(); i++)
+    frame.centers[i] = spheres[i].center;
+  const unsigned generation = frame.generation;
+  auto stale = [&] {
+    return frame_generation.load(std::memory_order_relaxed) != generation;
+  };
+
+  // Stale tiles count as started, so every planned tile is counted.
+  auto done = [](Clock::time_point start) {
+    local_counters().tile(
+        std::chrono::nanoseconds(Clock::now() - start).count());
+  };
+
+  const int n = frame.order.size(), chunk = tile_size * tile_size;
+  metrics.tiles_planned += frame.tiles.size() + (n + chunk - 1) / chunk;
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int t = 0; t < (int)frame.tiles.size(); t++) {
+    auto start = Clock::now();
+    if (stale()) {
+      done(start);
+      continue;
+    }
+    const Tile& tile = frame.tiles[t];
+    for (int y = tile.y0; y < tile.y1; y++)
+      for (int x = tile.x0; x < tile.x1; x++)
+        visibility(frame, x, y);
+    done(start);
+  }
+
+  // The shading pass goes over the same tiles, as flat runs of pixels. Each
+  // pixel is still shaded on its own: shade() traces shadow, reflection and
+  // refraction rays recursively, which does not vectorize.
+  // Chunks are handed out in order and a chunk once started is finished, so
+  // the shaded pixels are always a prefix of order: the center of each view.
+  int shaded = 0;
+#pragma omp parallel for schedule(dynamic, 1) reduction(max : shaded)
+  for (int begin = 0; begin < n; begin += chunk) {
+    auto start = Clock::now();
+    if (stale()) {
+      done(start);
+      continue;
+    }
+    for (int i = begin; i < std::min(begin + chunk, n); i++)
+      shade_pixel(frame, frame.order[i]);
+    shaded = std::max(shaded, std::min(begin + chunk, n));
+    done(start);
+  }
+  frame.shaded = shaded;
+  return !stale();
+}
+
+// How far object moved, given the offsets of the unpacked spheres.
+vec3 offset_of(const Bvh& bvh, const frame_vector<vec3>& offsets, int object) {
+  const int i = object >= 0 ? bvh.dynamic_index(object) : -1;
+  return i >= 0 && size_t(i) < offsets.size() ? offsets[i] : vec3{};
+}
+
+// Per-pixel motion vectors of prev as seen from the view cameras of next,
+// given how far every unpacked sphere moved since prev was traced. The
+// checkerboard, the background and packed spheres are static, so they only
+// move with the camera. Each pixel stays in its view.
+void motion_vectors(Frame& prev, const frame_vector<vec3>& offsets,
+                    const Frame& next) {
+#pragma omp parallel for
+  for (int pix = 0; pix < prev.width * prev.height; pix++) {
+    const int view = prev.view_index[pix];
+    const View& v = prev.views[view];
+    const Camera& cam = next.cameras[view];
+    int obj = prev.object[pix];
+    vec3 p = prev.point[pix] + offset_of(next.scene->bvh, offsets, obj);
+    if (obj == background) // points at infinity only rotate with the camera
+      p = cam.position + prev.view[pix];
+    float x, y;
+    if (project(cam, p, v.x1 - v.x0, v.y1 - v.y0, x, y))
+      x += v.x0, y += v.y0;
+    else
+      x = y = -prev.width; // behind the camera: lands off screen
+    prev.motion_x[pix] = x - pix % prev.width;
+    prev.motion_y[pix] = y - pix / prev.width;
+  }
+}
+
+// Synthesizes the view from out.camera of the current scene by
+// forward-splatting prev along its motion vectors with a depth test. Pixels
+// that receive no sample were disoccluded and are retraced.
+int reproject(Frame& prev, Frame& out) {
+  const Bvh& bvh = out.scene->bvh;
+  frame_vector<vec3> offsets(
+      std::min(prev.centers.size(), bvh.dynamic.size()));
+  for (size_t i = 0; i < offsets.size(); i++)
+    offsets[i] = bvh.dynamic[i].center - prev.centers[i];
+  motion_vectors(prev, offsets, out);
+  out.resize(prev.width, prev.height);
+  std::fill(out.depth.begin(), out.depth.end(), NAN);
+  for (int pix = 0; pix < prev.width * prev.height; pix++) {
+    int x = std::lround(pix % prev.width + prev.motion_x[pix]);
+    int y = std::lround(pix / prev.width + prev.motion_y[pix]);
+    if (x < 0 || y < 0 || x >= out.width || y >= out.height)
+      continue;
+    int view = out.view_at(x, y);
+    if (view != prev.view_index[pix])
+      continue; // moved out of its view
+    int obj = prev.object[pix];
+    vec3 p = prev.point[pix] + offset_of(bvh, offsets, obj);
+    vec3 eye = out.cameras[view].position;
+    float d = obj == background ? INFINITY : (p - eye).norm();
+    int dst = y * out.width + x;
+    if (d >= out.depth[dst]) // NaN compares false: empty pixels always take it
+      continue;
+    out.color[dst] = prev.color[pix];
+    out.depth[dst] = d;
+    out.object[dst] = obj;
+    out.point[dst] = p;
+    out.normal[dst] = prev.normal[pix];
+    out.view[dst] = prev.view[pix];
+  }
+
+  int retraced = 0;
+#pragma omp parallel for collapse(2) reduction(+ : retraced)
+  for (int y = 0; y < out.height; y++) {
+    for (int x = 0; x < out.width; x++) {
+      if (!std::isnan(out.depth[y * out.width + x]))
+        continue;
+      trace_pixel(out, x, y);
+      retraced++;
+    }
+  }
+  return retraced;
+}
+
+// Fills full from low, which was traced at 1/scale of its resolution. Each
+// pixel blends its four nearest low resolution samples, weighted bilinearly
+// and by how close each lies to the tangent plane of the nearest one. Where
+// those samples straddle a discontinuity (another object, a depth jump or a
+// crease) the filter would smear an edge, so the pixel is traced instead.
+// Returns the number of traced pixels.
+int upscale(const Frame& low, Frame& full, int scale) {
+  const vec3 no_sample = {NAN, 0, 0};
+#pragma omp parallel for collapse(2)
+  for (int y = 0; y < full.height; y++) {
+    for (int x = 0; x < full.width; x++) {
+      float u = std::clamp((x + 0.5f) / scale - 0.5f, 0.f, low.width - 1.f);
+      float v = std::clamp((y + 0.5f) / scale - 0.5f, 0.f, low.height - 1.f);
+      int x0 = u, y0 = v;
+      int x1 = std::min(x0 + 1, low.width - 1),
+          y1 = std::min(y0 + 1, low.height - 1);
+      const int taps[4] = {y0 * low.width + x0, y0 * low.width + x1,
+                           y1 * low.width + x0, y1 * low.width + x1};
+      const float bilinear[4] = {(1 - (u - x0)) * (1 - (v - y0)),
+                                 (u - x0) * (1 - (v - y0)),
+                                 (1 - (u - x0)) * (v - y0),
+                                 (u - x0) * (v - y0)};
+      int nearest = taps[(v - y0 > .5f) * 2 + (u - x0 > .5f)];
+      int pix = y * full.width + x, view = full.view_at(x, y);
+      full.object[pix] = low.object[nearest];
+      full.point[pix] = low.point[nearest];
+      full.normal[pix] = low.normal[nearest];
+      full.view[pix] = low.view[nearest];
+      full.depth[pix] = low.depth[nearest];
+
+      bool edge = false;
+      vec3 color;
+      float weight = 0;
+      for (int i = 0; i < 4; i++) {
+        int t = taps[i];
+        if (low.object[t] != low.object[nearest] ||
+            low.view_index[t] != view) {
+          edge = true;
+          break;
+        }
+        float range = 1; // the background is all at infinity
+        if (low.object[t] != background) {
+          // distance off the tangent plane, so flat floors never count
+          float dz = std::abs((low.point[t] - low.point[nearest]) *
+                              low.normal[nearest]) /
+                     (.05f * low.depth[nearest]);
+          if (dz > 1 || low.normal[t] * low.normal[nearest] < .8f) {
+            edge = true;
+            break;
+          }
+          range = 1 - dz;
+        }
+        color = color + low.color[t] * (bilinear[i] * range);
+        weight += bilinear[i] * range;
+      }
+      full.color[pix] = edge ? no_sample : color * (1 / weight);
+    }
+  }
+
+  int retraced = 0;
+#pragma omp parallel for collapse(2) reduction(+ : retraced)
+  for (int y = 0; y < full.height; y++) {
+    for (int x = 0; x < full.width; x++) {
+      if (!std::isnan(full.color[y * full.width + x].x))
+        continue;
+      trace_pixel(full, x, y);
+      retraced++;
+    }
+  }
+  return retraced;
+}
+
+// Input-to-photon latency: the time from an input event until the first frame
+// traced with that event's generation has been written to the terminal.
+class LatencyStats {
+public:
+  LatencyStats() {
+    sorted.reserve(samples.size()); // the loop runs allocation free
+  }
+
+  // Events past the capacity of pending are dropped; the earlier ones will
+  // be reflected by the same frame and measure a longer wait.
+  void input(unsigned generation) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending_count < pending.size())
+      pending[pending_count++] = {generation, Clock::now()};
+  }
+
+  // Called once a frame of this generation has been flushed to the terminal.
+  void presented(unsigned generation) {
+    auto now = Clock::now();
+    std::lock_guard<std::mutex> lock(mutex);
+    auto reflected = [&](const std::pair<unsigned, Clock::time_point>& e) {
+      return int(generation - e.first) >= 0;
+    };
+    size_t kept = 0;
+    for (size_t i = 0; i < pending_count; i++) {
+      const auto& e = pending[i];
+      if (!reflected(e)) {
+        pending[kept++] = e;
+        continue;
+      }
+      samples[count++ % samples.size()] =
+          std::chrono::duration<float, std::milli>(now - e.second).count();
+    }
+    pending_count = kept;
+  }
+
+  // p-th percentile in milliseconds of the most recent events, or NaN.
+  float percentile(float p) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t n = std::min(count, samples.size());
+    if (n == 0)
+      return NAN;
+    sorted.assign(samples.begin(), samples.begin() + n);
+    size_t k = std::min(n - 1, size_t(p / 100 * n));
+    std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+    return sorted[k];
+  }
+
+  size_t events() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return count;
+  }
+
+  // True while some input has not made it to the screen yet.
+  bool waiting() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return pending_count > 0;
+  }
+
+  void summary(char* buf, size_t size) {
+    snprintf(buf, size, "latency p50 %.1fms p95 %.1fms p99 %.1fms",
+             percentile(50), percentile(95), percentile(99));
+  }
+
+private:
+  std::mutex mutex;
+  std::array<std::pair<unsigned, Clock::time_point>, 64> pending;
+  size_t pending_count = 0;
+  std::array<float, 1024> samples{}; // ring of the most recent latencies
+  std::vector<float> sorted;
+  size_t count = 0;
+};
+
+LatencyStats latency;
+
+// Non-blocking terminal output. Whatever the terminal does not take right
+// away is kept in pending, and frames are dropped until it has drained, so a
+// slow link never stalls the render loop.
+class Output {
+public:
+  // Palette index of every cell once all queued bytes have arrived, or 0 if
+  // unknown. New frames only encode the cells that differ from it.
+  std::vector<unsigned char> delivered;
+  size_t dropped = 0, bytes_written = 0, bytes_saved = 0;
+  size_t last_full_size = 0; // bytes a complete frame would have taken
+  int error = 0; // errno of a failed write, after which output stops
+
+  // O_NONBLOCK is a flag of the open file, which a terminal's stdout shares
+  // with stdin. So a terminal is opened again, for output of its own.
+  void open(int fd) {
+    this->fd = fd;
+    const char* tty = isatty(fd) ? ttyname(fd) : nullptr;
+    if (tty) {
+      int own = ::open(tty, O_WRONLY | O_NOCTTY | O_CLOEXEC);
+      if (own >= 0) {
+        this->fd = own;
+        reopened = true;
+      }
+    }
+    flags = fcntl(this->fd, F_GETFL);
+    fcntl(this->fd, F_SETFL, flags | O_NONBLOCK);
+    pending.reserve(1 << 20);
+  }
+
+  // Blocks until everything is written and restores the descriptor.
+  void close() {
+    fcntl(fd, F_SETFL, flags);
+    flush();
+    if (reopened)
+      ::close(fd);
+  }
+
+  void resize(int width, int height) {
+    if (delivered.size() != size_t(width * height))
+      delivered.assign(width * height, 0);
+  }
+
+  size_t pending_bytes() const { return pending.size() - pending_offset; }
+
+  // True while the terminal is still behind on earlier frames.
+  bool busy() {
+    flush();
+    return !pending.empty();
+  }
+
+  // Writes as much as the terminal takes without blocking and queues the
+  // rest. latency learns about the frame once its last byte is out.
+  void write(iovec* spans, int count, unsigned generation) {
+    while (count > 0) {
+      ssize_t n = writev(fd, spans, std::min(count, IOV_MAX));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno != EAGAIN)
+        return fail(errno);
+      if (n < 0)
+        break;
+      bytes_written += n;
+      for (; count > 0 && size_t(n) >= spans->iov_len; count--)
+        n -= spans++->iov_len;
+      if (count > 0) {
+        spans->iov_base = static_cast<char*>(spans->iov_base) + n;
+        spans->iov_len -= n;
+      }
+    }
+    for (; count > 0; count--, spans++) {
+      const char* base = static_cast<const char*>(spans->iov_base);
+      pending.insert(pending.end(), base, base + spans->iov_len);
+    }
+    if (pending.empty())
+      latency.presented(generation);
+    else
+      pending_generation = generation;
+  }
+
+private:
+  int fd = STDOUT_FILENO, flags = 0;
+  bool reopened = false; // fd is our own descriptor of the terminal
+  std::vector<char> pending;
+  size_t pending_offset = 0;
+  unsigned pending_generation = 0;
+
+  void flush() {
+    while (pending_offset < pending.size()) {
+      ssize_t n = ::write(fd, pending.data() + pending_offset,
+                          pending.size() - pending_offset);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0 && errno != EAGAIN)
+        return fail(errno);
+      if (n < 0)
+        return;
+      bytes_written += n;
+      pending_offset += n;
+    }
+    if (!pending.empty()) {
+      pending.clear();
+      pending_offset = 0;
+      latency.presented(pending_generation);
+    }
+  }
+
+  // The terminal is gone, or the output file cannot take more: what is
+  // queued is discarded, and the render loop ends.
+  void fail(int e) {
+    if (!error)
+      error = e;
+    pending.clear();
+    pending_offset = 0;
+    running = false;
+  }
+};
+
+Output output;
+
+// Encodes the cells of one row that differ from what the terminal shows into
+// a span on the calling thread's frame arena: a cursor position before every
+// run of changed cells, then a square per pixel with a color change only
+// where needed. full_size receives the length of a complete row.
+iovec encode_row(const Frame& frame, int y, size_t& full_size) {
+  constexpr char square[] = "⬛"; // two columns wide
+  constexpr int cursor_size = 24;
+  size_t capacity =
+      frame.width * (cursor_size + sizeof(Sgr::bytes) + sizeof square);
+  char* row = static_cast<char*>(FrameArena::local().allocate(capacity, 1));
+  char* p = row;
+  unsigned char* shown = &output.delivered[y * frame.width];
+  int current = -1, full_current = -1;
+  bool contiguous = false;
+  full_size = cursor_size;
+  for (int x = 0; x < frame.width; x++) {
+    int c = quantize(frame.color[y * frame.width + x], x, y);
+    full_size += (c != full_current) * sgr_table[c].size + sizeof square - 1;
+    full_current = c;
+    if (c == shown[x]) {
+      contiguous = false;
+      continue;
+    }
+    if (!contiguous) {
+      p += snprintf(p, cursor_size, "\x1b[%d;%dH\x1b[40m", y + 1, 2 * x + 1);
+      contiguous = true;
+    }
+    if (c != current) {
+      std::memcpy(p, sgr_table[c].bytes, sgr_table[c].size);
+      p += sgr_table[c].size;
+      current = c;
+    }
+    std::memcpy(p, square, sizeof square - 1);
+    p += sizeof square - 1;
+    shown[x] = c;
+  }
+  return {row, size_t(p - row)};
+}
+
+// Show frames as Sixel graphics, one terminal pixel per frame pixel, instead
+// of one colored cell per pixel.
+bool sixel = false;
+
+// DCS introducer, raster size and the palette registers. Register i holds
+// xterm color i, so quantized indices are used as they are.
+std::string sixel_header(int width, int height) {
+  std::string header = "\x1bP0;1q\"1;1;" + std::to_string(width) + ";" +
+                       std::to_string(height);
+  for (int i = 16; i < 256; i++) {
+    vec3 c = xterm_color(i) * (100.f / 255);
+    char reg[32];
+    snprintf(reg, sizeof reg, "#%d;2;%d;%d;%d", i, int(c.x + .5f),
+             int(c.y + .5f), int(c.z + .5f));
+    header += reg;
+  }
+  return header;
+}
+
+// Encodes a band of six pixel rows into a span on the calling thread's frame
+// arena. Every color present in the band gets one line of sixel characters,
+// whose low six bits mark the rows that have the color, run-length encoded.
+iovec encode_sixel_band(const Frame& frame, int band) {
+  const int y0 = band * 6, rows = std::min(6, frame.height - y0);
+  FrameArena& arena = FrameArena::local();
+  auto* index = static_cast<unsigned char*>(arena.allocate(6 * frame.width, 1));
+  bool used[256] = {};
+  int colors = 0;
+  for (int r = 0; r < rows; r++)
+    for (int x = 0; x < frame.width; x++) {
+      int c = quantize(frame.color[(y0 + r) * frame.width + x], x, y0 + r);
+      index[r * frame.width + x] = c;
+      colors += !used[c];
+      used[c] = true;
+    }
+
+  // "#ccc" + at most one character per pixel + "$", then "-"
+  size_t capacity = colors * (frame.width + 6) + 1;
+  char* out = static_cast<char*>(arena.allocate(capacity, 1));
+  char* p = out;
+  for (int c = 16; c < 256; c++) {
+    if (!used[c])
+      continue;
+    p += snprintf(p, 5, "#%d", c);
+    char run_char = 0;
+    int run = 0;
+    auto flush = [&] {
+      if (run > 3) { // "!" and the digits are never longer than the run
+        p += snprintf(p, sizeof "!2147483647", "!%d", run);
+        *p++ = run_char;
+      } else {
+        std::memset(p, run_char, run);
+        p += run;
+      }
+    };
+    for (int x = 0; x < frame.width; x++) {
+      int bits = 0;
+      for (int r = 0; r < rows; r++)
+        bits |= (index[r * frame.width + x] == c) << r;
+      char ch = '?' + bits;
+      if (ch != run_char) {
+        flush();
+        run_char = ch;
+        run = 0;
+      }
+      run++;
+    }
+    if (run_char != '?') // trailing empty sixels are implied
+      flush();
+    *p++ = '$';
+  }
+  *p++ = '-';
+  return {out, size_t(p - out)};
+}
+
+// Bands are encoded in parallel, then written as one image at the top left
+// below the status line.
+void present_sixel(const Frame& frame, const char* status) {
+  static std::string header;
+  static int header_width = 0, header_height = 0;
+  if (frame.width != header_width || frame.height != header_height) {
+    header = sixel_header(frame.width, frame.height);
+    header_width = frame.width;
+    header_height = frame.height;
+  }
+  const int bands = (frame.height + 5) / 6;
+  frame_vector<iovec> spans(bands + 3);
+  char line[160];
+  int n = snprintf(line, sizeof line, "\x1b[H\x1b[0m%s\x1b[K\r\n", status);
+  spans[0] = {line, size_t(std::min<int>(n, sizeof line - 1))};
+  spans[1] = {header.data(), header.size()};
+#pragma omp parallel for schedule(dynamic, 1)
+  for (int band = 0; band < bands; band++)
+    spans[band + 2] = encode_sixel_band(frame, band);
+  spans[bands + 2] = {const_cast<char*>("\x1b\\"), 2};
+  size_t size = 0;
+  for (const iovec& span : spans)
+    size += span.iov_len;
+  output.last_full_size = size;
+  output.write(spans.data(), spans.size(), frame.generation);
+}
+
+// Rows are encoded in parallel; the calling thread only gathers the spans
+// into one writev. status, if not empty, goes on the line below the image.
+// Returns false if the frame was dropped because the terminal is behind.
+bool present(const Frame& frame, const char* status = "") {
+  if (output.busy()) {
+    output.dropped++;
+    output.bytes_saved += output.last_full_size;
+    return false;
+  }
+  if (sixel) {
+    present_sixel(frame, status);
+    return true;
+  }
+  output.resize(frame.width, frame.height);
+  frame_vector<iovec> spans(frame.height + 1);
+  size_t full_size = 0, sent_size = 0;
+#pragma omp parallel for schedule(dynamic, 1)                                  \
+    reduction(+ : full_size, sent_size)
+  for (int y = 0; y < frame.height; y++) {
+    size_t row_size;
+    spans[y] = encode_row(frame, y, row_size);
+    full_size += row_size;
+    sent_size += spans[y].iov_len;
+  }
+  output.last_full_size = full_size;
+  output.bytes_saved += full_size - sent_size;
+  char line[160];
+  int n = snprintf(line, sizeof line, "\x1b[%d;1H\x1b[0m%s\x1b[K",
+                   frame.height + 1, status);
+  spans[frame.height] = {line, size_t(std::min<int>(n, sizeof line - 1))};
+  output.write(spans.data(), *status ? spans.size() : frame.height,
+               frame.generation);
+  return true;
+}
+
+// What became of a frame handed to render(): partial if it went stale, but
+// the part that was done is on screen.
+enum class Rendered { cancelled, partial, dropped, shown };
+
+// Traces and presents frame. With a scale above 1 the frame is traced into
+// low, at reduced resolution, and upscaled. If the frame goes stale, the
+// tiles shaded by then, which are those nearest the center, are shown over
+// on_screen, the frame the screen shows: input is reflected where the viewer
+// looks before the frame is done, however often it is cancelled.
+Rendered render(Frame& frame, Frame& low, const Frame& on_screen,
+                const char* status, int scale) {
+  bool done;
+  if (scale > 1) {
+    low.resize(std::max(1, frame.width / scale),
+               std::max(1, frame.height / scale));
+    low.scene = frame.scene;
+    low.set_camera(frame.camera);
+    low.generation = frame.generation;
+    // The rest of low is still its last trace.
+    done = trace(low);
+    if (!done && !low.shaded)
+      return Rendered::cancelled;
+    frame.centers = low.centers;
+    upscale(low, frame, scale);
+  } else {
+    done = trace(frame);
+    if (!done && (!frame.shaded || on_screen.width != frame.width ||
+                  on_screen.height != frame.height))
+      return Rendered::cancelled;
+    if (!done && &on_screen != &frame)
+      for (size_t i = frame.shaded; i < frame.order.size(); i++)
+        frame.color[frame.order[i]] = on_screen.color[frame.order[i]];
+  }
+  if (!present(frame, status))
+    return done ? Rendered::dropped : Rendered::cancelled;
+  return done ? Rendered::shown : Rendered::partial;
+}
+
+// Moves the camera with wasd, turns with j/l, quits with q.
+void handle_key(char c) {
+  std::lock_guard<std::mutex> lock(camera_mutex);
+  vec3 forward = camera.to_world({0, 0, -0.5}),
+       right = camera.to_world({0.5, 0, 0});
+  switch (c) {
+  case 'w':
+    camera.position = camera.position + forward;
+    break;
+  case 's':
+    camera.position = camera.position - forward;
+    break;
+  case 'a':
+    camera.position = camera.position - right;
+    break;
+  case 'd':
+    camera.position = camera.position + right;
+    break;
+  case 'j':
+    camera.yaw += 0.05;
+    break;
+  case 'l':
+    camera.yaw -= 0.05;
+    break;
+  case 'q':
+    running = false;
+    break;
+  default:
+    return;
+  }
+  latency.input(++frame_generation);
+}
+
+void read_input() {
+  profile_thread();
+  pollfd pfd{STDIN_FILENO, POLLIN, 0};
+  while (running) {
+    char c;
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    if (read(STDIN_FILENO, &c, 1) != 1)
+      break;
+    handle_key(c);
+  }
+}
+
+// Stands in for a user in bench mode: turns the camera back and forth, 100ms
+// after seeing the result of the previous key, so slow scenes still finish
+// frames.
+void simulate_input() {
+  profile_thread();
+  for (int i = 0; running; i++) {
+    while (running && latency.waiting())
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    handle_key(i / 10 % 2 ? 'l' : 'j');
+  }
+}
+
+// step is the fraction of a frame to advance; two half steps equal one frame
+void animate(float step = 1.f) {
+  for (int i = 0; i < (int)scene.nodes.size(); i++) {
+    const SceneNode& node = scene.nodes[i];
+    if (node.spin != 0)
+      set_local(scene, i,
+                node.local *
+                    Transform::rotation_y(node.spin * step * M_PI / 180));
+  }
+  update_world(scene);
+  for (int i : scene.moved)
+    scene.bvh.refit(i);
+}
+
+// BVHs built by earlier runs, in files named after Bvh::key().
+struct BvhCache {
+  // What a build_bvh() did: whether it loaded the tree, the seconds it took,
+  // and the seconds the build took.
+  struct Build {
+    bool hit = false;
+    float seconds = 0, build_seconds = 0;
+
+    // Of a hit. Loading a tiny tree can take longer than building it did,
+    // which saves nothing rather than a negative amount, as counters only
+    // go up.
+    float saved() const { return std::max(0.f, build_seconds - seconds); }
+  };
+
+  std::string dir; // empty for no cache; set before any thread starts
+  // Server sessions and the scene watcher build concurrently with main.
+  std::mutex mutex; // serializes build_bvh(), guards last_build
+  Build last_build;
+
+  Build last() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return last_build;
+  }
+} bvh_cache;
+
+// Builds scene.bvh and hands the spheres over to it, as hand_over_spheres()
+// does. The tree is loaded from the cache instead if there is one and an
+// earlier run built it for the same spheres. A missing, stale or corrupt file
+// means a build, which is saved for next time.
+void build_bvh(Scene& scene, bool exact = false) {
+  if (bvh_cache.dir.empty()) {
+    scene.bvh.build(scene.spheres);
+    return hand_over_spheres(scene, exact);
+  }
+  std::lock_guard<std::mutex> lock(bvh_cache.mutex);
+  BvhCache::Build& build = bvh_cache.last_build;
+  auto start = Clock::now();
+  auto since_start = [&] {
+    return std::chrono::duration<float>(Clock::now() - start).count();
+  };
+  const uint64_t key = Bvh::key(scene.spheres);
+  char name[32];
+  snprintf(name, sizeof name, "/bvh-%016llx", (unsigned long long)key);
+  const std::string path = bvh_cache.dir + name;
+  build.hit = scene.bvh.load(path, key, scene.spheres, build.build_seconds);
+  if (build.hit) {
+    build.seconds = since_start();
+    metrics.bvh_cache_hits++;
+    metrics.bvh_seconds_saved = metrics.bvh_seconds_saved + build.saved();
+    return hand_over_spheres(scene, exact);
+  }
+  scene.bvh.build(scene.spheres);
+  build.seconds = build.build_seconds = since_start();
+  metrics.bvh_cache_misses++;
+  mkdir(bvh_cache.dir.c_str(), 0755);
+  if (!scene.bvh.save(path, key, build.build_seconds))
+    metrics.bvh_cache_errors++;
+  hand_over_spheres(scene, exact);
+}
+
+// Deterministic scenes for scaling studies, from a spec "kind:count[:seed]":
+//   random:N   N spheres of random size and material scattered over the floor
+//   glass:N    a row of N overlapping glass spheres along the view axis
+//   mirrors:N  a corridor of N mirror spheres on either side
+//   lights:N   the default spheres lit by N lights
+// All but lights:N are lit by lights. Returns false if the spec is not
+// understood. The scene has no BVH yet, so that build_bvh() can be timed on
+// its own.
+bool generate_scene(const std::string& spec, std::vector<vec3> lights,
+                    Scene& out) {
+  char kind[16];
+  unsigned count = 0, seed = 1;
+  if (sscanf(spec.c_str(), "%15[a-z]:%u:%u", kind, &count, &seed) < 2 ||
+      count == 0)
+    return false;
+  std::mt19937 rng(seed);
+  // Not std::uniform_real_distribution, whose output differs between
+  // standard libraries.
+  auto uniform = [&](float lo, float hi) {
+    return lo + (hi - lo) * ((rng() >> 8) * (1.f / (1 << 24)));
+  };
+  out = {};
+  out.lights = std::move(lights);
+  std::string name = kind;
+  if (name == "random") {
+    // Keep the total volume about constant, so the spheres neither vanish
+    // nor fill the box as the count grows.
+    float radius = std::min(2.f, 5.f / std::cbrt(float(count)));
+    for (unsigned i = 0; i < count; i++)
+      out.spheres.push_back({{uniform(-10, 10), uniform(-4, 6),
+                              uniform(-40, -10)},
+                             radius * uniform(.5, 1.5),
+                             uint16_t(rng() % std::size(preset_materials))});
+  } else if (name == "glass") {
+    for (unsigned i = 0; i < count; i++)
+      out.spheres.push_back({{uniform(-.3, .3), uniform(-.3, .3),
+                              -8.f - 1.5f * i},
+                             1.f, glass});
+  } else if (name == "mirrors") {
+    for (unsigned i = 0; i < count; i++)
+      for (float side : {-1.f, 1.f})
+        out.spheres.push_back({{side * 5, 0, -8.f - 4.f * i}, 2.f, mirror});
+  } else if (name == "lights") {
+    out.spheres = default_layout().spheres;
+    out.lights.clear();
+    for (unsigned i = 0; i < count; i++) {
+      float angle = uniform(0, 2 * M_PI), height = uniform(10, 50);
+      out.lights.push_back({40 * std::cos(angle), height,
+                            -18 + 40 * std::sin(angle)});
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// Reads a scene file. Each line is one of
+//   material NAME IOR A0 A1 A2 A3 R G B SPECULAR
+//   group NAME PARENT X Y Z SPIN
+//   sphere X Y Z RADIUS MATERIAL [GROUP]
+//   light X Y Z
+//   animate
+// where # starts a comment and the materials ivory, glass, red_rubber and
+// mirror are predefined. A group is a scene graph node at X Y Z in PARENT, or
+// at the root for "-", turning SPIN degrees per frame; spheres in a group are
+// placed relative to it and move with it. animate makes spheres 2 and 3 orbit
+// as in the default scene. On failure error describes the first bad line and
+// out is untouched.
+bool load_scene(const std::string& path, Scene& out, std::string& error) {
+  std::ifstream in(path);
+  if (!in) {
+    error = path + ": " + strerror(errno);
+    return false;
+  }
+  std::map<std::string, uint16_t> materials = {{"ivory", ivory},
+                                               {"glass", glass},
+                                               {"red_rubber", red_rubber},
+                                               {"mirror", mirror}};
+  std::map<std::string, int> groups = {{"-", -1}};
+  Scene loaded;
+  bool animate = false;
+  std::string line;
+  for (int number = 1; std::getline(in, line); number++) {
+    line = line.substr(0, line.find('#'));
+    char cmd[16], name[64], group[64] = "-";
+    Material m;
+    Sphere sphere;
+    vec3 v;
+    float spin;
+    bool ok = true;
+    if (sscanf(line.c_str(), "%15s", cmd) != 1)
+      continue;
+    if (!strcmp(cmd, "material")) {
+      ok = sscanf(line.c_str(), "%*s %63s %f %f %f %f %f %f %f %f %f", name,
+                  &m.refractive_index, &m.albedo[0], &m.albedo[1],
+                  &m.albedo[2], &m.albedo[3], &m.diffuse_color.x,
+                  &m.diffuse_color.y, &m.diffuse_color.z,
+                  &m.specular_exponent) == 10 &&
+           loaded.materials.size() <= UINT16_MAX;
+      if (ok) { // redefining a name leaves the spheres before as they were
+        materials[name] = loaded.materials.size();
+        loaded.materials.push_back(m);
+      }
+    } else if (!strcmp(cmd, "group")) {
+      ok = sscanf(line.c_str(), "%*s %63s %63s %f %f %f %f", name, group, &v.x,
+                  &v.y, &v.z, &spin) == 6 &&
+           groups.count(group) && !groups.count(name);
+      if (ok)
+        groups[name] = add_node(loaded, groups[group],
+                                Transform::translation(v), -1, spin);
+    } else if (!strcmp(cmd, "sphere")) {
+      vec3& c = sphere.center;
+      ok = sscanf(line.c_str(), "%*s %f %f %f %f %63s %63s", &c.x, &c.y, &c.z,
+                  &sphere.radius, name, group) >= 5 &&
+           sphere.radius > 0 && materials.count(name) && groups.count(group);
+      if (ok) {
+        sphere.material = materials[name];
+        loaded.spheres.push_back(sphere);
+        if (groups[group] >= 0)
+          add_node(loaded, groups[group], Transform::translation(c),
+                   loaded.spheres.size() - 1);
+      }
+    } else if (!strcmp(cmd, "light")) {
+      ok = sscanf(line.c_str(), "%*s %f %f %f", &v.x, &v.y, &v.z) == 3;
+      if (ok)
+        loaded.lights.push_back(v);
+    } else if (!strcmp(cmd, "animate")) {
+      animate = true;
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      error = path + ":" + std::to_string(number) + ": cannot parse: " + line;
+      return false;
+    }
+  }
+  if (animate && loaded.spheres.size() < 4) {
+    error = path + ": animate needs at least 4 spheres";
+    return false;
+  }
+  if (animate)
+    add_orbits(loaded);
+  update_world(loaded);
+  build_bvh(loaded, true); // unpacked, for the scene watcher
+  out = std::move(loaded);
+  return true;
+}
+
+bool operator==(const Material& a, const Material& b) {
+  return a.refractive_index == b.refractive_index &&
+         std::equal(a.albedo, a.albedo + 4, b.albedo) &&
+         a.diffuse_color.x == b.diffuse_color.x &&
+         a.diffuse_color.y == b.diffuse_color.y &&
+         a.diffuse_color.z == b.diffuse_color.z &&
+         a.specular_exponent == b.specular_exponent;
+}
+
+bool operator==(const vec3& a, const vec3& b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+bool operator==(const Sphere& a, const Sphere& b) {
+  return a.center == b.center && a.radius == b.radius &&
+         a.material == b.material;
+}
+
+bool operator==(const Transform& a, const Transform& b) {
+  return a.x == b.x && a.y == b.y && a.z == b.z && a.origin == b.origin;
+}
+
+// Reloads the scene file whenever it is saved. The watcher thread parses the
+// file and diffs it against the previous version; the render loop then takes
+// over just the spheres and lights that differ, between two frames. Editors
+// that save by renaming a new file over the old one are handled by watching
+// the directory rather than the file.
+class SceneWatcher {
+public:
+  void start(const std::string& file, const Scene& initial) {
+    path = file;
+    size_t slash = path.rfind('/');
+    dir = slash == std::string::npos ? "." : path.substr(0, slash + 1);
+    name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+    base = initial;
+    thread = std::thread(&SceneWatcher::watch, this);
+  }
+
+  void join() {
+    if (thread.joinable())
+      thread.join();
+  }
+
+  // Brings live up to date with the latest edit, if any. Never blocks: if
+  // the watcher is busy publishing, the edit waits for the next frame.
+  // Returns true if spheres were added or removed or the scene graph changed,
+  // which invalidates per-sphere data of earlier frames.
+  bool apply(Scene& live) {
+    if (!ready.load(std::memory_order_acquire))
+      return false;
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock)
+      return false;
+    ready = false;
+    // Swapping hands the old vectors to the watcher, which frees them, so
+    // the render thread allocates nothing either way.
+    if (resized) {
+      live.lights.swap(pending.lights);
+      live.materials.swap(pending.materials);
+      live.nodes.swap(pending.nodes);
+      std::swap(live.bvh, pending.bvh); // built by load_scene()
+    } else {
+      // Only edited nodes are reset, so the rest of the graph keeps its
+      // current animation state. Spheres in the graph get their center
+      // from their node.
+      for (int k : changed_nodes) {
+        set_local(live, k, pending.nodes[k].local);
+        live.nodes[k].spin = pending.nodes[k].spin;
+      }
+      // Scene files are kept unpacked, so this allocates nothing either.
+      for (int i : changed_spheres) {
+        live.bvh.set(i, pending.bvh.sphere(i));
+        for (SceneNode& node : live.nodes)
+          node.dirty |= node.sphere == i;
+      }
+      for (int i : changed_lights)
+        live.lights[i] = pending.lights[i];
+      if (changed_materials) // the same size, so copying allocates nothing
+        live.materials = pending.materials;
+      for (int i : changed_spheres)
+        live.bvh.refit(i);
+    }
+    update_world(live);
+    for (int i : live.moved)
+      live.bvh.refit(i);
+    metrics.scene_objects_updated +=
+        resized ? live.bvh.size() + live.lights.size() + live.nodes.size()
+                : changed_spheres.size() + changed_lights.size() +
+                      changed_nodes.size();
+    metrics.scene_reloads++;
+    bool was_resized = resized;
+    changed_nodes.clear();
+    changed_spheres.clear();
+    changed_lights.clear();
+    changed_materials = resized = false;
+    return was_resized;
+  }
+
+private:
+  std::string path, dir, name;
+  std::thread thread;
+  Scene base; // the file as of the last edit, watcher thread only
+
+  std::mutex mutex; // guards the rest, and is only held briefly
+  std::atomic<bool> ready{false}; // an edit is waiting for apply()
+  Scene pending;
+  std::vector<int> changed_spheres, changed_lights, changed_nodes;
+  bool changed_materials = false, resized = false;
+
+  void watch() {
+    profile_thread();
+    may_allocate = true;
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(),
+                                    IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+      perror(("watching " + dir).c_str());
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+    alignas(inotify_event) char events[4096];
+    pollfd pfd{fd, POLLIN, 0};
+    while (running) {
+      if (poll(&pfd, 1, 100) <= 0)
+        continue;
+      bool touched = false;
+      ssize_t n;
+      while ((n = read(fd, events, sizeof events)) > 0) {
+        for (char* p = events; p < events + n;) {
+          auto* event = reinterpret_cast<inotify_event*>(p);
+          touched |= event->len && name == event->name;
+          p += sizeof(inotify_event) + event->len;
+        }
+      }
+      if (touched)
+        reload();
+    }
+    close(fd);
+  }
+
+  void reload() {
+    Scene next;
+    std::string error;
+    if (!load_scene(path, next, error)) {
+      metrics.scene_reload_errors++;
+      if (!isatty(STDERR_FILENO))
+        std::cerr << error << "\n";
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    // Diffed against the previous edit rather than the live scene, so
+    // animated spheres are not reset by edits elsewhere in the file. Edits
+    // that arrive before the render loop took the last one accumulate.
+    if (next.bvh.size() != base.bvh.size() ||
+        next.lights.size() != base.lights.size() ||
+        next.materials.size() != base.materials.size() ||
+        next.nodes.size() != base.nodes.size())
+      resized = true;
+    changed_materials |= !resized && next.materials != base.materials;
+    for (size_t k = 0; !resized && k < next.nodes.size(); k++) {
+      const SceneNode &a = next.nodes[k], &b = base.nodes[k];
+      if (a.parent != b.parent || a.sphere != b.sphere)
+        resized = true;
+      else if (!(a.local == b.local) || a.spin != b.spin)
+        changed_nodes.push_back(k);
+    }
+    for (size_t i = 0; !resized && i < next.bvh.size(); i++)
+      if (!(next.bvh.sphere(i) == base.bvh.sphere(i)))
+        changed_spheres.push_back(i);
+    for (size_t i = 0; !resized && i < next.lights.size(); i++)
+      if (!(next.lights[i] == base.lights[i]))
+        changed_lights.push_back(i);
+    base = next;
+    pending = std::move(next);
+    ready = true;
+  }
+} scene_watcher;
+
+// Serves the metrics in Prometheus text format to anyone connecting to
+// 127.0.0.1:port, until the render loop stops. Responses are formatted into
+// a fixed buffer, so scraping allocates nothing and takes no locks.
+void serve_metrics(int port) {
+  profile_thread();
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0 ||
+      listen(server, 4) < 0) {
+    perror("metrics endpoint");
+    close(server);
+    return;
+  }
+  static char response[16384];
+  pollfd pfd{server, POLLIN, 0};
+  while (running) {
+    if (poll(&pfd, 1, 100) <= 0)
+      continue;
+    int client = accept(server, nullptr, nullptr);
+    if (client < 0)
+      continue;
+    char request[1024];
+    timeval timeout{1, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    recv(client, request, sizeof request, 0); // any request gets the metrics
+
+    char* p = response;
+    char* end = response + sizeof response;
+    auto emit = [&](const char* name, const char* type, const char* help,
+                    double value) {
+      p += snprintf(p, end - p, "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n",
+                    name, help, name, type, name, value);
+    };
+    p += snprintf(p, end - p,
+                  "HTTP/1.0 200 OK\r\n"
+                  "Content-Type: text/plain; version=0.0.4\r\n\r\n");
+    emit("raytracer_frames_total", "counter", "Frames rendered.",
+         metrics.frames);
+    emit("raytracer_frames_cancelled_total", "counter",
+         "Frames abandoned because the camera moved.", metrics.cancelled);
+    emit("raytracer_frames_dropped_total", "counter",
+         "Frames skipped because the terminal fell behind.", metrics.dropped);
+    emit("raytracer_frame_seconds", "gauge", "Duration of the last frame.",
+         metrics.frame_seconds);
+    emit("raytracer_output_bytes_total", "counter",
+         "Bytes written to the terminal.", metrics.output_bytes);
+    emit("raytracer_output_pending_bytes", "gauge",
+         "Bytes waiting for the terminal.", metrics.output_pending);
+    // Read in this order, tiles of a frame planned in between can only make
+    // the count look smaller, and it is clamped at zero.
+    const uint64_t planned = metrics.tiles_planned;
+    const uint64_t started = total(&ThreadCounters::tiles);
+    emit("raytracer_tiles_queued", "gauge",
+         "Tiles of the current frame not yet started.",
+         planned > started ? planned - started : 0);
+    emit("raytracer_rays_total", "counter", "Rays intersected with the scene.",
+         total(&ThreadCounters::rays));
+    emit("raytracer_scene_reloads_total", "counter",
+         "Edits of the scene file applied.", metrics.scene_reloads);
+    emit("raytracer_scene_reload_errors_total", "counter",
+         "Edits of the scene file rejected as invalid.",
+         metrics.scene_reload_errors);
+    emit("raytracer_scene_objects_updated_total", "counter",
+         "Spheres, lights and nodes replaced by scene file edits.",
+         metrics.scene_objects_updated);
+    emit("raytracer_bvh_cache_hits_total", "counter",
+         "BVHs loaded from the cache instead of built.",
+         metrics.bvh_cache_hits);
+    emit("raytracer_bvh_cache_misses_total", "counter",
+         "BVHs built because the cache had none.", metrics.bvh_cache_misses);
+    emit("raytracer_bvh_cache_errors_total", "counter",
+         "Built BVHs that could not be saved to the cache.",
+         metrics.bvh_cache_errors);
+    emit("raytracer_bvh_cache_seconds_saved_total", "counter",
+         "Build time saved by loading BVHs from the cache.",
+         metrics.bvh_seconds_saved);
+    p += snprintf(p, end - p,
+                  "# HELP raytracer_thread_busy_seconds_total Time spent on "
+                  "tiles per thread.\n"
+                  "# TYPE raytracer_thread_busy_seconds_total counter\n");
+    int threads = std::min<int>(counted_threads, max_counted_threads);
+    for (int i = 0; i < threads && end - p > 80; i++) {
+      double busy =
+          thread_counters[i].busy_ns.load(std::memory_order_relaxed) * 1e-9;
+      p += snprintf(p, end - p,
+                    "raytracer_thread_busy_seconds_total{thread=\"%d\"} %.9f\n",
+                    i, busy);
+    }
+    send(client, response, p - response, MSG_NOSIGNAL);
+    close(client);
+  }
+  close(server);
+}
+
+// Opt-in sampling profiler for hosts without perf. SIGPROF fires for every
+// millisecond of CPU time the process uses, and the handler copies the
+// interrupted thread's stack into a buffer reserved for that thread. Threads
+// get their buffers as they start, in add_thread(), so the handler only
+// follows a pointer. Symbolizing waits until the run is over.
+class Profiler {
+public:
+  static constexpr int depth = 32, samples_per_thread = 8192;
+
+  // Samples from now on, for writing to path at exit.
+  void start(const std::string& path) {
+    this->path = path;
+    void* warmup[1];
+    backtrace(warmup, 1); // loads the unwinder outside of the handler
+    active = true;
+    add_thread();
+#pragma omp parallel
+    add_thread(); // the OpenMP workers stay for the rest of the run
+
+    struct sigaction action{};
+    action.sa_sigaction = on_sigprof;
+    action.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, nullptr);
+    itimerval every_ms{{0, 1000}, {0, 1000}};
+    setitimer(ITIMER_PROF, &every_ms, nullptr);
+  }
+
+  // Gives the calling thread its buffer, once, while profiling.
+  void add_thread() {
+    if (!active || current)
+      return;
+    auto buffer = std::make_unique<Buffer>();
+    buffer->pcs = std::make_unique<void*[]>(samples_per_thread * depth);
+    std::lock_guard<std::mutex> lock(mutex);
+    current = buffer.get();
+    buffers.push_back(std::move(buffer));
+  }
+
+  // Stops sampling and writes one line per distinct stack, outermost frame
+  // first, as flamegraph.pl and friends expect.
+  void write_folded() {
+    itimerval off{};
+    setitimer(ITIMER_PROF, &off, nullptr);
+    signal(SIGPROF, SIG_IGN);
+    std::lock_guard<std::mutex> lock(mutex);
+    std::map<void*, std::string> names;
+    auto name = [&](void* pc) -> const std::string& {
+      auto [it, inserted] = names.try_emplace(pc);
+      if (!inserted)
+        return it->second;
+      Dl_info info;
+      if (!dladdr(pc, &info)) {
+        char hex[24];
+        snprintf(hex, sizeof hex, "%p", pc);
+        it->second = hex;
+      } else if (!info.dli_sname) {
+        // Local symbols such as OpenMP outlined regions: module and offset,
+        // which addr2line can resolve.
+        const char* module = std::strrchr(info.dli_fname, '/');
+        char where[256];
+        snprintf(where, sizeof where, "[%s+%#zx]",
+                 module ? module + 1 : info.dli_fname,
+                 size_t(static_cast<char*>(pc) -
+                        static_cast<char*>(info.dli_fbase)));
+        it->second = where;
+      } else {
+        int status;
+        char* demangled =
+            abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        it->second = status == 0 ? demangled : info.dli_sname;
+        std::free(demangled);
+        it->second = it->second.substr(0, it->second.find('(')); // no args
+      }
+      return it->second;
+    };
+    std::map<std::string, int> stacks;
+    for (const auto& buffer : buffers) {
+      const Buffer& b = *buffer;
+      for (int i = 0; i < b.count; i++) {
+        std::string stack;
+        for (int d = b.depths[i] - 1; d >= 0; d--)
+          stack += (stack.empty() ? "" : ";") + name(b.pcs[i * depth + d]);
+        stacks[stack]++;
+      }
+    }
+    std::ofstream out(path);
+    for (const auto& [stack, count] : stacks)
+      out << stack << ' ' << count << '\n';
+    if (lost)
+      std::cerr << "profiler: " << lost
+                << " samples lost to full buffers or unknown threads\n";
+  }
+
+private:
+  struct Buffer {
+    std::unique_ptr<void*[]> pcs;
+    unsigned char depths[samples_per_thread];
+    int count = 0;
+  };
+  std::string path;
+  std::mutex mutex; // guards buffers
+  std::vector<std::unique_ptr<Buffer>> buffers;
+  bool active = false;
+  std::atomic<int> lost{0};
+  // Constant-initialized, so reading it needs no lazy setup in the handler.
+  static inline thread_local Buffer* current = nullptr;
+
+  static void on_sigprof(int, siginfo_t*, void* context);
+
+  // Async-signal-safe: only touches this thread's buffer.
+  void sample(void* context) {
+    if (!current || current->count == samples_per_thread) {
+      lost++;
+      return;
+    }
+    Buffer& b = *current;
+    void** pcs = &b.pcs[b.count * depth];
+    int n = backtrace(pcs, depth);
+    // Drop the handler's own frames: the stack starts again at the
+    // interrupted instruction.
+    int skip = std::min(n, 2);
+#ifdef REG_RIP
+    void* interrupted = reinterpret_cast<void*>(
+        static_cast<ucontext_t*>(context)->uc_mcontext.gregs[REG_RIP]);
+    for (int i = 0; i < n; i++)
+      if (pcs[i] == interrupted)
+        skip = i;
+#endif
+    std::memmove(pcs, pcs + skip, (n - skip) * sizeof *pcs);
+    b.depths[b.count++] = n - skip;
+  }
+} profiler;
+
+void Profiler::on_sigprof(int, siginfo_t*, void* context) {
+  int saved_errno = errno;
+  profiler.sample(context);
+  errno = saved_errno;
+}
+
+void profile_thread() { profiler.add_thread(); }
+
+// Query mode: reads all rays from stdin, answers them as one batch and
+// prints one line per ray, "t object px py pz nx ny nz" for nearest hits
+// ("- -2" for a miss) or 0/1 for occlusion. Throughput goes to stderr.
+int answer_queries(bool occlusion) {
+  std::vector<vec3> origins, dirs;
+  std::vector<float> tmax;
+  vec3 o, d;
+  float t;
+  while (scanf("%f %f %f %f %f %f %f", &o.x, &o.y, &o.z, &d.x, &d.y, &d.z,
+               &t) == 7) {
+    if (!(d.norm() > 0)) { // would normalize to NaN
+      std::cerr << "ray " << origins.size() + 1 << ": zero direction\n";
+      return 1;
+    }
+    origins.push_back(o);
+    dirs.push_back(d.normalized());
+    tmax.push_back(t);
+  }
+  if (!feof(stdin)) {
+    std::cerr << "ray " << origins.size() + 1 << ": expected 7 numbers\n";
+    return 1;
+  }
+  const size_t n = origins.size();
+  std::vector<RayHit> hits(occlusion ? 0 : n);
+  std::vector<uint8_t> occluded(occlusion ? n : 0);
+
+  auto start = Clock::now();
+  if (occlusion)
+    occluded_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                   occluded.data());
+  else
+    intersect_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                    hits.data());
+  float seconds = std::chrono::duration<float>(Clock::now() - start).count();
+
+  for (size_t i = 0; i < n; i++) {
+    if (occlusion) {
+      printf("%d\n", occluded[i]);
+    } else if (hits[i].object == background) {
+      printf("- %d\n", background);
+    } else {
+      const RayHit& h = hits[i];
+      printf("%g %d %g %g %g %g %g %g\n", h.t, h.object, h.point.x,
+             h.point.y, h.point.z, h.normal.x, h.normal.y, h.normal.z);
+    }
+  }
+  fprintf(stderr, "%zu %s queries in %.3fs, %.3g rays/s\n", n,
+          occlusion ? "occlusion" : "nearest hit", seconds, n / seconds);
+  return 0;
+}
+
+// Measures the acceleration structure over random:count: the best of three
+// builds, the memory per sphere, the expected query cost by the SAH (count
+// for brute force), and query rates for the primary rays of a 1000x1000
+// image.
+int bench_bvh(int count) {
+  if (!generate_scene("random:" + std::to_string(count),
+                      default_layout().lights, scene)) {
+    std::cerr << "--bench-bvh needs a sphere count\n";
+    return 1;
+  }
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  float build_seconds = INFINITY;
+  for (int i = 0; i < 3; i++) {
+    auto start = Clock::now();
+    scene.bvh.build(scene.spheres);
+    build_seconds = std::min(
+        build_seconds,
+        std::chrono::duration<float>(Clock::now() - start).count());
+  }
+  hand_over_spheres(scene);
+  printf("%d spheres: built in %.3fs on %d threads, %zu nodes, SAH cost "
+         "%.1f\n",
+         count, build_seconds, threads, scene.bvh.nodes.size(),
+         scene.bvh.sah_cost());
+  printf("%.1f bytes per sphere in the BVH, %zu of them for the sphere "
+         "itself (%zu as floats)\n",
+         double(scene.bvh.memory()) / count, sizeof(PackedSphere),
+         sizeof(Sphere));
+
+  const int size = 1000, n = size * size;
+  std::vector<vec3> origins(n, camera.position), dirs(n);
+  std::vector<float> tmax(n, 1000);
+  for (int i = 0; i < n; i++)
+    dirs[i] = primary_dir(camera, i % size, i / size, size, size);
+  std::vector<RayHit> hits(n);
+  std::vector<uint8_t> occluded(n);
+  auto start = Clock::now();
+  intersect_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                  hits.data());
+  float nearest = std::chrono::duration<float>(Clock::now() - start).count();
+  start = Clock::now();
+  occluded_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                 occluded.data());
+  float any = std::chrono::duration<float>(Clock::now() - start).count();
+  printf("%d primary rays: %.3g nearest hit rays/s, %.3g occlusion rays/s\n",
+         n, n / nearest, n / any);
+  return 0;
+}
+
+// Writes buffers to files in the background, for offline rendering. The
+// writer owns a fixed set of buffers: the renderer fills one, submits it
+// and takes the next, and only waits for the disk when all of them are still
+// queued. Writes go through io_uring with the buffers registered, so the
+// kernel does not map them for every write, and completions are reaped by
+// whoever calls acquire(); without io_uring (old kernels, seccomp filters) a
+// thread calls pwrite instead.
+class AsyncWriter {
+public:
+  ~AsyncWriter() {
+    finish();
+    if (worker.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+      }
+      wake.notify_all();
+      worker.join();
+    }
+    close_ring();
+  }
+
+  // Sets up count buffers of size bytes each.
+  void open(int count, size_t size) {
+    buffer_size = size;
+    memory.resize(count * size);
+    jobs.resize(count);
+    for (int id = count - 1; id >= 0; id--)
+      free_ids.push_back(id);
+    if (!open_ring(count))
+      worker = std::thread(&AsyncWriter::work, this);
+  }
+
+  const char* backend() const { return ring >= 0 ? "io_uring" : "pwrite"; }
+
+  // A free buffer to fill, and its id for submit().
+  char* acquire(int& id) {
+    auto start = Clock::now();
+    if (ring >= 0) {
+      reap(free_ids.empty());
+      while (free_ids.empty())
+        reap(true);
+    } else {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return !free_ids.empty(); });
+    }
+    waited_seconds +=
+        std::chrono::duration<float>(Clock::now() - start).count();
+    std::lock_guard<std::mutex> lock(mutex);
+    id = free_ids.back();
+    free_ids.pop_back();
+    return memory.data() + id * buffer_size;
+  }
+
+  // Queues writing the first size bytes of buffer id to fd at offset, and
+  // closing fd once this and every earlier write to it are done.
+  void submit(int id, int fd, off_t offset, size_t size, bool close_after) {
+    std::lock_guard<std::mutex> lock(mutex);
+    jobs[id] = {fd, offset, size, 0};
+    if (size_t(fd) >= fd_writes.size()) {
+      fd_writes.resize(fd + 1);
+      fd_closing.resize(fd + 1);
+    }
+    fd_writes[fd]++;
+    fd_closing[fd] = close_after;
+    if (ring >= 0) {
+      push(id);
+    } else {
+      queue.push_back(id);
+      wake.notify_all();
+    }
+  }
+
+  // Whether a write or close has failed, which finish() will report.
+  bool failed() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return error != 0;
+  }
+
+  // Closes fd once the writes submitted to it are done, for a file that is
+  // abandoned before its last write.
+  void release(int fd) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (size_t(fd) < fd_writes.size() && fd_writes[fd]) {
+      fd_closing[fd] = true;
+    } else if (close(fd) < 0 && !error) {
+      error = errno;
+    }
+  }
+
+  // Waits until everything submitted is written and closed. Returns false,
+  // with errno set, if anything failed.
+  bool finish() {
+    const size_t count = jobs.size();
+    if (ring >= 0) {
+      while (free_ids.size() < count)
+        reap(true);
+    } else {
+      std::unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] { return free_ids.size() == count; });
+    }
+    errno = error;
+    return !error;
+  }
+
+  float waited_seconds = 0; // in acquire(), waiting for the disk
+
+private:
+  struct Job {
+    int fd;
+    off_t offset;
+    size_t size, done;
+  };
+  size_t buffer_size = 0;
+  std::vector<char> memory; // the buffers, back to back
+  std::vector<Job> jobs;    // by buffer id
+  std::vector<int> free_ids;
+  std::vector<int> fd_writes;    // writes in flight by fd
+  std::vector<bool> fd_closing;  // close each fd when its writes are done
+  int error = 0;                 // errno of the first failure
+
+  // pwrite fallback. mutex also guards the bookkeeping above, which the
+  // worker updates as writes complete.
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::deque<int> queue;
+  std::thread worker;
+  bool stopping = false;
+
+  // io_uring, used from the submitting thread only.
+  int ring = -1;
+  void* sq_map = MAP_FAILED;
+  void* cq_map = MAP_FAILED;
+  size_t sq_map_size = 0, cq_map_size = 0;
+  io_uring_sqe* sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+  size_t sqes_size = 0;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  io_uring_cqe* cqes;
+  unsigned unsubmitted = 0; // entries queued that the kernel has not taken
+
+  bool open_ring(int count) {
+    io_uring_params params{};
+    ring = syscall(__NR_io_uring_setup, count, &params);
+    if (ring < 0)
+      return false;
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+      sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+    sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    cq_map = single ? sq_map
+                    : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, ring,
+                           IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe*>(
+        mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES));
+    std::vector<iovec> buffers(count);
+    for (int id = 0; id < count; id++)
+      buffers[id] = {memory.data() + id * buffer_size, buffer_size};
+    if (sq_map == MAP_FAILED || cq_map == MAP_FAILED || sqes == MAP_FAILED ||
+        syscall(__NR_io_uring_register, ring, IORING_REGISTER_BUFFERS,
+                buffers.data(), count) < 0) {
+      close_ring();
+      return false;
+    }
+    char* sq = static_cast<char*>(sq_map);
+    char* cq = static_cast<char*>(cq_map);
+    sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+    return true;
+  }
+
+  void close_ring() {
+    if (sqes != MAP_FAILED)
+      munmap(sqes, sqes_size);
+    if (cq_map != MAP_FAILED && cq_map != sq_map)
+      munmap(cq_map, cq_map_size);
+    if (sq_map != MAP_FAILED)
+      munmap(sq_map, sq_map_size);
+    sqes = static_cast<io_uring_sqe*>(MAP_FAILED);
+    sq_map = cq_map = MAP_FAILED;
+    if (ring >= 0)
+      close(ring);
+    ring = -1;
+  }
+
+  // Submits the rest of job id. Each buffer has at most one write in
+  // flight, and the rings have an entry per buffer, so there is always room.
+  void push(int id) {
+    const Job& job = jobs[id];
+    unsigned tail = *sq_tail, index = tail & *sq_mask;
+    io_uring_sqe& sqe = sqes[index];
+    memset(&sqe, 0, sizeof sqe);
+    sqe.opcode = IORING_OP_WRITE_FIXED;
+    sqe.fd = job.fd;
+    sqe.addr = uint64_t(memory.data() + id * buffer_size + job.done);
+    sqe.len = job.size - job.done;
+    sqe.off = job.offset + job.done;
+    sqe.buf_index = id;
+    sqe.user_data = id;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    unsubmitted++;
+    enter(false);
+  }
+
+  // Hands the queued entries to the kernel, then waits for a completion if
+  // wait. Entries refused for a passing reason stay queued for the next
+  // call. On any other failure the kernel never saw them, so they are taken
+  // back out of the ring and completed with the error.
+  void enter(bool wait) {
+    int n = syscall(__NR_io_uring_enter, ring, unsubmitted, wait ? 1 : 0,
+                    wait ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (n >= 0) {
+      unsubmitted -= n;
+      return;
+    }
+    const int failure = errno;
+    if (failure == EINTR || failure == EAGAIN || failure == EBUSY)
+      return;
+    unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    const unsigned tail = *sq_tail;
+    __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+    unsubmitted = 0;
+    for (; head != tail; head++)
+      completed(sqes[sq_array[head & *sq_mask]].user_data, -failure);
+  }
+
+  // Handles the completions there are, first waiting for one if wait.
+  void reap(bool wait) {
+    if (wait || unsubmitted)
+      enter(wait);
+    unsigned head = *cq_head;
+    while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+      const io_uring_cqe& cqe = cqes[head & *cq_mask];
+      int id = cqe.user_data;
+      long result = cqe.res;
+      __atomic_store_n(cq_head, ++head, __ATOMIC_RELEASE);
+      Job& job = jobs[id];
+      if (result > 0 && job.done + result < job.size) {
+        job.done += result; // short write: submit the rest
+        push(id);
+      } else {
+        completed(id, result == 0 ? -EIO : result);
+      }
+    }
+  }
+
+  void work() {
+    profile_thread();
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [&] { return stopping || !queue.empty(); });
+      if (queue.empty())
+        return;
+      int id = queue.front();
+      queue.pop_front();
+      Job job = jobs[id];
+      lock.unlock();
+      const char* data = memory.data() + id * buffer_size;
+      long result = 0;
+      while (job.done < job.size) {
+        ssize_t n = pwrite(job.fd, data + job.done, job.size - job.done,
+                           job.offset + job.done);
+        if (n < 0 && errno == EINTR)
+          continue;
+        if (n <= 0) {
+          result = n < 0 ? -errno : -EIO;
+          break;
+        }
+        job.done += n;
+      }
+      lock.lock();
+      completed(id, result);
+      wake.notify_all();
+    }
+  }
+
+  // Books the end of job id; result is negative errno on failure. Called
+  // with mutex held, or from the submitting thread with io_uring.
+  void completed(int id, long result) {
+    const int fd = jobs[id].fd;
+    if (result < 0 && !error)
+      error = -result;
+    if (!--fd_writes[fd] && fd_closing[fd]) {
+      fd_closing[fd] = false;
+      if (close(fd) < 0 && !error)
+        error = errno;
+    }
+    free_ids.push_back(id);
+  }
+};
+
+// Still mode renders images of the scene at sizes whose framebuffer would
+// not fit in memory: one of the scene as it starts, or a sequence of
+// animation frames to files named by a printf pattern. Rows are traced in
+// bands of about still_band_bytes of output, in parallel within a band, and
+// handed to an AsyncWriter, so the few bands in its queue are all that is
+// ever held. A path ending in .pfm gets float RGB, anything else 8-bit binary
+// PPM. PFM stores the bottom row first, so its bands are traced bottom up
+// and files are still written front to back.
+constexpr size_t still_band_bytes = 8 << 20;
+constexpr int still_buffers = 4; // one being traced, the rest being written
+
+// Whether path is safe to give snprintf with a frame number: exactly one
+// %d, with flags and a width if any, and otherwise only %% escapes.
+bool is_frame_pattern(const std::string& path) {
+  int conversions = 0;
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] != '%')
+      continue;
+    if (++i < path.size() && path[i] == '%')
+      continue;
+    i = path.find_first_not_of("-+ #0", i);
+    i = path.find_first_not_of("0123456789", i);
+    if (i == std::string::npos || path[i] != 'd')
+      return false;
+    conversions++;
+  }
+  return conversions == 1;
+}
+
+int render_still(const std::string& path, int width, int height,
+                 int frames) {
+  if (frames > 1 && !is_frame_pattern(path)) {
+    std::cerr << "--frames needs a file name pattern with one %d, like "
+                 "out%04d.ppm\n";
+    return 1;
+  }
+  const bool pfm = path.size() >= 4 && path.substr(path.size() - 4) == ".pfm";
+  const size_t row_bytes = size_t(width) * 3 * (pfm ? sizeof(float) : 1);
+  const int band_rows = std::max<size_t>(
+      1, std::min<size_t>(height, still_band_bytes / row_bytes));
+  char header[64];
+  const int header_size =
+      snprintf(header, sizeof header,
+               pfm ? "PF\n%d %d\n-1.0\n" : "P6\n%d %d\n255\n", width,
+               height); // -1: little-endian floats
+  AsyncWriter writer;
+  writer.open(still_buffers, header_size + band_rows * row_bytes);
+
+  const Camera cam = camera;
+  auto start = Clock::now();
+  bool ok = true;
+  for (int frame = 0; ok && !writer.failed() && frame < frames; frame++) {
+    if (frame)
+      animate();
+    char name[4096];
+    if (frames > 1)
+      snprintf(name, sizeof name, path.c_str(), frame);
+    else
+      snprintf(name, sizeof name, "%s", path.c_str());
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(name);
+      ok = false;
+      break;
+    }
+    for (int first = 0; first < height; first += band_rows) {
+      const int rows = std::min(band_rows, height - first);
+      if (writer.failed()) { // no use tracing what cannot be written
+        writer.release(fd);
+        break;
+      }
+      int id;
+      char* buf = writer.acquire(id);
+      // The header goes out with the first band.
+      size_t offset = header_size + first * row_bytes, size = rows * row_bytes;
+      char* pixels = buf;
+      if (!first) {
+        memcpy(buf, header, header_size);
+        pixels += header_size;
+        offset = 0;
+        size += header_size;
+      }
+#pragma omp parallel for schedule(dynamic)
+      for (int r = 0; r < rows; r++) {
+        // Rows in file order, which for PFM is from the bottom of the image.
+        const int y = pfm ? height - 1 - (first + r) : first + r;
+        char* out = pixels + r * row_bytes;
+        for (int x = 0; x < width; x++) {
+          vec3 c = cast_ray(scene, cam.position,
+                            primary_dir(cam, x, y, width, height));
+          for (int k = 0; k < 3; k++) {
+            if (pfm)
+              memcpy(out + (3 * x + k) * sizeof(float), &c[k], sizeof(float));
+            else
+              out[3 * x + k] = 255 * std::max(0.f, std::min(1.f, c[k]));
+          }
+        }
+      }
+      writer.submit(id, fd, offset, size, first + rows == height);
+    }
+  }
+  const bool written = writer.finish();
+  if (!written)
+    perror(frames > 1 ? "writing frames" : path.c_str());
+  if (!ok || !written)
+    return 1;
+  float seconds = std::chrono::duration<float>(Clock::now() - start).count();
+  fprintf(stderr,
+          "%d frame%s of %dx%d in %.2fs (%.3g pixels/s), bands of %d rows, "
+          "%.1f MiB buffered, waited %.2fs for %s writes\n",
+          frames, frames > 1 ? "s" : "", width, height, seconds,
+          double(frames) * width * height / seconds, band_rows,
+          double(still_buffers) * (header_size + band_rows * row_bytes) /
+              (1 << 20),
+          writer.waited_seconds, writer.backend());
+  return 0;
+}
+
+// Shares one pool of worker threads between the frames of several sessions
+// of the render server, tile by tile. Sessions earn quantum_ns of tracing
+// time per round, deficit round robin style, and pay for each tile they are
+// handed: an estimate from their recent cost per pixel up front, corrected
+// by the measured time when the tile is done. Among the sessions with tiles
+// waiting and credit left, the one whose frame is due first goes next. So
+// deadlines order the work within a round, and the rounds keep a heavy scene
+// from taking more than its share while others wait; when no one else has
+// work it gets every worker.
+class TileScheduler {
+public:
+  static constexpr double quantum_ns = 2e6;
+
+  // A session's place in the scheduler, and its statistics.
+  struct Queue {
+    int id = 0;
+    Frame* frame = nullptr; // being traced, null when the session is idle
+    size_t next = 0;        // next tile of frame to hand out
+    int unfinished = 0;     // tiles of frame not yet traced
+    Clock::time_point deadline, queued; // of the frame in flight
+    double deficit = 0;      // tracing time left this round, in ns
+    double ns_per_pixel = 1e3; // moving average, for estimating tiles
+    std::condition_variable done;
+    // Totals, and the same since the last report().
+    uint64_t frames = 0, tiles = 0;
+    double queue_ns = 0, max_queue_ns = 0, busy_ns = 0;
+    uint64_t interval_frames = 0, interval_tiles = 0;
+    double interval_queue_ns = 0;
+    Clock::time_point started = Clock::now(), reported = started;
+  };
+
+  void start(int threads) {
+    for (int i = 0; i < threads; i++)
+      workers.emplace_back(&TileScheduler::work, this);
+  }
+
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers)
+      worker.join();
+    workers.clear();
+  }
+
+  void add(Queue& queue) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queues.push_back(&queue);
+  }
+
+  void remove(Queue& queue) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queues.erase(std::find(queues.begin(), queues.end(), &queue));
+  }
+
+  // Traces frame on the pool, due at deadline, and returns when it is done.
+  void render(Queue& queue, Frame& frame, Clock::time_point deadline) {
+    std::unique_lock<std::mutex> lock(mutex);
+    queue.frame = &frame;
+    queue.next = 0;
+    queue.unfinished = frame.tiles.size();
+    metrics.tiles_planned += frame.tiles.size();
+    queue.deadline = deadline;
+    queue.queued = Clock::now();
+    // Credit is not kept across idle time, but debt is.
+    queue.deficit = std::min(queue.deficit, 0.);
+    wake.notify_all();
+    queue.done.wait(lock, [&] { return !queue.frame; });
+    queue.frames++;
+    queue.interval_frames++;
+  }
+
+  // Prints frame rate and queue time of every session since the last call.
+  void report() {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto now = Clock::now();
+    for (Queue* q : queues) {
+      float seconds = std::chrono::duration<float>(now - q->reported).count();
+      fprintf(stderr,
+              "session %d: %.1f fps, %.2fms mean tile queue time over %lu "
+              "tiles\n",
+              q->id, q->interval_frames / seconds,
+              q->interval_tiles ? q->interval_queue_ns / q->interval_tiles *
+                                      1e-6
+                                : 0.,
+              (unsigned long)q->interval_tiles);
+      q->interval_frames = q->interval_tiles = 0;
+      q->interval_queue_ns = 0;
+      q->reported = now;
+    }
+  }
+
+private:
+  std::mutex mutex; // guards everything, including the queues' fields
+  std::condition_variable wake;
+  std::vector<Queue*> queues;
+  std::vector<std::thread> workers;
+  bool stopping = false;
+
+  // The session to take a tile from, or null if no tiles are waiting.
+  Queue* pick() {
+    for (;;) {
+      Queue* best = nullptr;
+      bool waiting = false;
+      for (Queue* q : queues) {
+        if (!q->frame || q->next == q->frame->tiles.size())
+          continue;
+        waiting = true;
+        if (q->deficit > 0 && (!best || q->deadline < best->deadline))
+          best = q;
+      }
+      if (best || !waiting)
+        return best;
+      for (Queue* q : queues) // everyone waiting is out of credit: new round
+        if (q->frame && q->next < q->frame->tiles.size())
+          q->deficit += quantum_ns;
+    }
+  }
+
+  void work() {
+    profile_thread();
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+      Queue* q = nullptr;
+      wake.wait(lock, [&] { return stopping || (q = pick()); });
+      if (!q)
+        return;
+      Frame& frame = *q->frame;
+      const Tile& tile = frame.tiles[q->next++];
+      const double estimate =
+          q->ns_per_pixel * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+      q->deficit -= estimate;
+      auto start = Clock::now();
+      double waited = std::chrono::nanoseconds(start - q->queued).count();
+      q->queue_ns += waited;
+      q->interval_queue_ns += waited;
+      q->max_queue_ns = std::max(q->max_queue_ns, waited);
+      lock.unlock();
+
+      for (int y = tile.y0; y < tile.y1; y++)
+        for (int x = tile.x0; x < tile.x1; x++)
+          trace_pixel(frame, x, y);
+      const double took =
+          std::chrono::nanoseconds(Clock::now() - start).count();
+      local_counters().tile(took);
+
+      lock.lock();
+      q->deficit += estimate - took;
+      q->ns_per_pixel =
+          .9 * q->ns_per_pixel +
+          .1 * took / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0));
+      q->busy_ns += took;
+      q->tiles++;
+      q->interval_tiles++;
+      if (!--q->unfinished) {
+        q->frame = nullptr;
+        q->done.notify_all();
+      }
+    }
+  }
+};
+
+// Pipe mode turns the tracer into a filter. Commands arrive on stdin, one per
+// line:
+//   camera X Y Z YAW   place the camera
+//   sphere I X Y Z     move sphere I
+//   light I X Y Z      move light I
+//   size W H           image size of the following frames
+//   scene SPEC         switch to a generate_scene() scene, or "default"
+//   fps N              frames due 1/N s after they are requested (server)
+//   render             request a frame of everything received so far
+//   quit               stop after the requested frames
+// Each frame goes to stdout as the magic "ARTF", then width, height and the
+// number of render commands it answers as little-endian uint32, then
+// width * height RGB triplets, row by row.
+//
+// Commands are read on their own thread and folded into one pending state.
+// The renderer always takes the latest state, so a burst of updates and
+// render requests that arrives during a frame is answered by one frame.
+//
+// The render server runs a Pipe per client over its socket, tracing on a
+// shared TileScheduler instead of the OpenMP threads.
+class Pipe {
+public:
+  Pipe(int in = STDIN_FILENO, int out = STDOUT_FILENO,
+       TileScheduler* scheduler = nullptr)
+      : in(in), out(out), scheduler(scheduler) {}
+
+  TileScheduler::Queue queue; // with a scheduler
+
+  int run(int width, int height) {
+    state.width = width;
+    state.height = height;
+    state.scene = std::make_shared<Scene>(scene);
+    std::thread reader(&Pipe::read_commands, this);
+    if (scheduler)
+      scheduler->add(queue);
+    Frame frame;
+    for (;;) {
+      uint32_t answered;
+      Clock::time_point deadline;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&] { return requested > sent || done; });
+        if (requested == sent)
+          break;
+        snapshot = state.scene;
+        frame.scene = snapshot.get();
+        frame.set_camera(state.camera);
+        frame.resize(state.width, state.height);
+        answered = requested - sent;
+        sent = requested;
+        deadline = requested_at + std::chrono::microseconds(
+                                      int64_t(1e6 / state.fps));
+      }
+      frame.generation = frame_generation;
+      if (scheduler)
+        scheduler->render(queue, frame, deadline);
+      else
+        trace(frame);
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        snapshot.reset(); // apply() may change the scene in place again
+      }
+      if (!write_frame(frame, answered))
+        break;
+    }
+    if (scheduler)
+      scheduler->remove(queue);
+    stopping = true;
+    reader.join();
+    return 0;
+  }
+
+private:
+  struct State {
+    std::shared_ptr<Scene> scene; // shared with snapshot while it traces
+    Camera camera;
+    int width, height;
+    float fps = 30;
+  };
+
+  const int in, out;
+  TileScheduler* const scheduler;
+  std::mutex mutex;
+  std::condition_variable changed;
+  State state;         // guarded by mutex
+  uint64_t requested = 0, sent = 0; // render commands received and answered
+  Clock::time_point requested_at;   // of the first unanswered render
+  bool done = false;   // quit or end of input
+  std::shared_ptr<const Scene> snapshot; // what the current frame traces
+  std::atomic<bool> stopping{false};     // tells the reader to return
+  std::vector<uint8_t> buf; // the frame being written, reused
+
+  // Polls, so run() can stop it whatever in is: shutdown() only wakes a
+  // blocked read on a socket, not on a pipe or terminal.
+  void read_commands() {
+    profile_thread();
+    std::string input; // read but not yet applied
+    std::string line;
+    char chunk[4096];
+    pollfd pfd{in, POLLIN, 0};
+    bool eof = false;
+    while (!stopping && !eof) {
+      if (poll(&pfd, 1, 100) <= 0)
+        continue;
+      ssize_t n = read(in, chunk, sizeof chunk);
+      if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        continue;
+      if (n > 0)
+        input.append(chunk, n);
+      else
+        eof = true; // a last line may lack its newline
+      std::unique_lock<std::mutex> lock(mutex);
+      size_t start = 0;
+      while (!done && start < input.size()) {
+        size_t end = input.find('\n', start);
+        if (end == std::string::npos && !eof)
+          break;
+        end = end == std::string::npos ? input.size() : end + 1;
+        line.assign(input, start, end - start);
+        start = end;
+        if (!apply(line.c_str(), lock))
+          fprintf(stderr, "pipe: ignoring %s", line.c_str());
+      }
+      input.erase(0, start);
+      if (done)
+        break;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    done = true;
+    changed.notify_one();
+  }
+
+  // The scene for apply() to change, copied first if a frame traces it.
+  Scene& scene_to_change() {
+    if (state.scene.use_count() > 1)
+      state.scene = std::make_shared<Scene>(*state.scene);
+    return *state.scene;
+  }
+
+  // Updates the pending state; called with mutex held by lock.
+  bool apply(const char* line, std::unique_lock<std::mutex>& lock) {
+    char cmd[16];
+    char spec[64];
+    int i, w, h;
+    vec3 v;
+    float yaw, fps;
+    if (sscanf(line, "%15s", cmd) != 1)
+      return true; // blank line
+    if (!strcmp(cmd, "camera") &&
+        sscanf(line, "%*s %f %f %f %f", &v.x, &v.y, &v.z, &yaw) == 4) {
+      state.camera = {v, yaw};
+    } else if (!strcmp(cmd, "sphere") &&
+               sscanf(line, "%*s %d %f %f %f", &i, &v.x, &v.y, &v.z) == 4 &&
+               i >= 0 && i < (int)state.scene->bvh.size()) {
+      Scene& scene = scene_to_change();
+      scene.bvh.move(i, v);
+      scene.bvh.refit(i);
+    } else if (!strcmp(cmd, "light") &&
+               sscanf(line, "%*s %d %f %f %f", &i, &v.x, &v.y, &v.z) == 4 &&
+               i >= 0 && i < (int)state.scene->lights.size()) {
+      scene_to_change().lights[i] = v;
+    } else if (!strcmp(cmd, "size") &&
+               sscanf(line, "%*s %d %d", &w, &h) == 2 && w > 0 && h > 0 &&
+               w <= 16384 && h <= 16384) {
+      state.width = w;
+      state.height = h;
+    } else if (!strcmp(cmd, "scene") &&
+               sscanf(line, "%*s %63s", spec) == 1) {
+      // Made without the lock, so frames keep going while a large scene
+      // builds. Only this thread changes the state, so it cannot change
+      // in between.
+      lock.unlock();
+      auto next = std::make_shared<Scene>();
+      bool ok = true;
+      if (!strcmp(spec, "default"))
+        *next = default_scene();
+      else if ((ok = generate_scene(spec, default_layout().lights, *next)))
+        build_bvh(*next);
+      lock.lock();
+      if (!ok)
+        return false;
+      state.scene = std::move(next);
+    } else if (!strcmp(cmd, "fps") && sscanf(line, "%*s %f", &fps) == 1 &&
+               fps > 0) {
+      state.fps = fps;
+    } else if (!strcmp(cmd, "render")) {
+      if (requested == sent)
+        requested_at = Clock::now();
+      requested++;
+      changed.notify_one();
+    } else if (!strcmp(cmd, "quit")) {
+      done = true;
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  bool write_frame(const Frame& frame, uint32_t answered) {
+    buf.resize(16 + 3 * frame.color.size());
+    memcpy(buf.data(), "ARTF", 4);
+    const uint32_t header[] = {uint32_t(frame.width), uint32_t(frame.height),
+                               answered};
+    for (int i = 0; i < 12; i++)
+      buf[4 + i] = header[i / 4] >> (8 * (i % 4));
+    uint8_t* rgb = buf.data() + 16;
+    for (const vec3& c : frame.color)
+      for (int k = 0; k < 3; k++)
+        *rgb++ = 255 * std::max(0.f, std::min(1.f, c[k]));
+    for (size_t written = 0; written < buf.size();) {
+      ssize_t n = write(out, buf.data() + written, buf.size() - written);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return false; // the consumer went away
+      written += n;
+    }
+    return true;
+  }
+};
+
+// Render server: every client connecting to 127.0.0.1:port gets a session
+// speaking the pipe protocol over its socket, with its own scene, camera and
+// image size. All sessions trace on one pool of workers, one per OpenMP
+// thread, through a TileScheduler. Frame rates and tile queue times go to
+// stderr every report_seconds and when a session ends.
+int serve(int port, int width, int height) {
+  constexpr int report_seconds = 5;
+  int server = socket(AF_INET, SOCK_STREAM, 0);
+  int yes = 1;
+  setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (bind(server, reinterpret_cast<sockaddr*>(&addr), sizeof addr) < 0 ||
+      listen(server, 16) < 0) {
+    perror("render server");
+    close(server);
+    return 1;
+  }
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  TileScheduler scheduler;
+  scheduler.start(threads);
+  fprintf(stderr, "serving on 127.0.0.1:%d with %d workers\n", port,
+          threads);
+
+  struct Session {
+    std::thread thread;
+    int client;
+    std::atomic<bool> finished{false};
+  };
+  std::list<Session> sessions;
+  int next_id = 1;
+  auto last_report = Clock::now();
+  // SIGINT and SIGTERM stop the server. Without SA_RESTART they also cut
+  // the poll short.
+  struct sigaction stop{};
+  stop.sa_handler = [](int) { running = false; };
+  sigemptyset(&stop.sa_mask);
+  sigaction(SIGINT, &stop, nullptr);
+  sigaction(SIGTERM, &stop, nullptr);
+  pollfd pfd{server, POLLIN, 0};
+  while (running) {
+    if (poll(&pfd, 1, 100) > 0) {
+      int client = accept(server, nullptr, nullptr);
+      if (client >= 0) {
+        Session& session = sessions.emplace_back();
+        session.client = client;
+        const int id = next_id++;
+        session.thread = std::thread([&session, client, id, &scheduler,
+                                      width, height] {
+          profile_thread();
+          Pipe pipe(client, client, &scheduler);
+          pipe.queue.id = id;
+          pipe.run(width, height);
+          const TileScheduler::Queue& q = pipe.queue;
+          float seconds =
+              std::chrono::duration<float>(Clock::now() - q.started).count();
+          fprintf(stderr,
+                  "session %d done: %lu frames in %.1fs (%.1f fps), tile "
+                  "queue time %.2fms mean, %.2fms max, %.2fs traced\n",
+                  id, (unsigned long)q.frames, seconds, q.frames / seconds,
+                  q.tiles ? q.queue_ns / q.tiles * 1e-6 : 0.,
+                  q.max_queue_ns * 1e-6, q.busy_ns * 1e-9);
+          session.finished = true;
+        });
+      }
+    }
+    for (auto it = sessions.begin(); it != sessions.end();) {
+      if (it->finished) {
+        it->thread.join();
+        close(it->client); // only now, so teardown never hits a reused fd
+        it = sessions.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    if (Clock::now() - last_report > std::chrono::seconds(report_seconds)) {
+      scheduler.report();
+      last_report = Clock::now();
+    }
+  }
+  close(server);
+  // Ends the sessions: their readers see end of input and blocked writes
+  // fail.
+  for (Session& session : sessions)
+    shutdown(session.client, SHUT_RDWR);
+  for (Session& session : sessions) {
+    session.thread.join();
+    close(session.client);
+  }
+  scheduler.stop();
+  fprintf(stderr, "render server stopped\n");
+  return 0;
+}
+
+struct Options {
+  bool interpolate = false; // trace every other frame, reproject the rest
+  bool stats = false;       // show the stats overlay below the image
+  int bench_frames = 0;     // render this many frames headless, then report
+  int scale = 1;            // trace at 1/scale resolution and upscale
+  bool check_alloc = false; // abort on heap allocation in steady state
+  bool dither = false;      // ordered dithering when quantizing to the palette
+  bool sixel = false;       // Sixel graphics instead of colored cells
+  int width = 0, height = 0; // image size, 0 for the default of the backend
+  std::string output;       // in bench mode, write frames here
+  int metrics_port = 0;     // serve Prometheus metrics on localhost
+  std::string profile;      // write folded stacks from SIGPROF samples here
+  std::string scene;        // generate_scene() spec, empty for the default
+  std::string query;        // answer "nearest" or "occluded" ray queries
+  bool pipe = false;        // commands on stdin, binary frames on stdout
+  int serve_port = 0;       // render server for pipe clients on localhost
+  std::string scene_file;   // load_scene() this file and reload on changes
+  int bench_bvh = 0;        // measure the BVH over this many spheres, then exit
+  std::string bvh_cache;    // keep built BVHs in this directory
+  std::string still;        // render images to this PPM or PFM file
+  int frames = 1;           // animation frames to render with --still
+  std::string views;        // split screen layout, empty for one view
+};
+
+constexpr char usage[] = R"(usage: %s [options]
+  --interpolate    trace every other frame, reproject the ones in between
+  --scale 1|2|4    trace at reduced resolution and upscale
+  --dither         ordered dithering when quantizing colors
+  --sixel          draw Sixel graphics instead of colored cells
+  --size WxH       image size (80x40 cells, 320x160 Sixel pixels)
+  --scene SPEC     generated scene: random:N, glass:N, mirrors:N or lights:N,
+                   optionally followed by :seed
+  --scene-file FILE
+                   load the scene from FILE and reload it whenever it changes
+  --query KIND     read rays "ox oy oz dx dy dz tmax" from stdin and print
+                   their nearest hits or occlusion instead of rendering
+  --pipe           take commands on stdin and write RGB frames to stdout
+  --serve PORT     serve pipe sessions to clients of 127.0.0.1:PORT, each
+                   with its own scene, sharing the render threads fairly,
+                   until SIGINT or SIGTERM
+  --still FILE     render one image in bands to a PPM, or PFM for FILE.pfm,
+                   at --size (default 1920x1080)
+  --frames N       with --still, render N frames of the animation to files
+                   named by a pattern like out%%04d.ppm
+  --views LIST     split the screen into up to 4 views of main, top or side,
+                   e.g. main,top,side; the first one takes the left half
+  --stats          show fps, latency and output counters below the image
+  --bench N        render N frames headless, then print statistics
+  --bench-bvh N    time building and querying the BVH over N random spheres
+  --bvh-cache DIR  save built BVHs in DIR and load them on later runs
+  --output FILE    where --bench writes frames (default /dev/null)
+  --check-alloc    abort on heap allocation once the loop is running
+  --metrics-port P serve Prometheus metrics on 127.0.0.1:P
+  --profile FILE   sample stacks while running, write them folded to FILE
+)";
+
+Options parse_options(int argc, char** argv) {
+  Options opts;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--interpolate") {
+      opts.interpolate = true;
+    } else if (arg == "--stats") {
+      opts.stats = true;
+    } else if (arg == "--bench" && i + 1 < argc) {
+      opts.bench_frames = std::atoi(argv[++i]);
+    } else if (arg == "--bench-bvh" && i + 1 < argc) {
+      opts.bench_bvh = std::atoi(argv[++i]);
+    } else if (arg == "--dither") {
+      opts.dither = true;
+    } else if (arg == "--check-alloc") {
+      opts.check_alloc = true;
+    } else if (arg == "--scale" && i + 1 < argc) {
+      opts.scale = std::atoi(argv[++i]);
+      if (opts.scale != 1 && opts.scale != 2 && opts.scale != 4) {
+        std::cerr << "--scale must be 1, 2 or 4\n";
+        std::exit(1);
+      }
+    } else if (arg == "--sixel") {
+      opts.sixel = true;
+    } else if (arg == "--size" && i + 1 < argc) {
+      if (sscanf(argv[++i], "%dx%d", &opts.width, &opts.height) != 2 ||
+          opts.width <= 0 || opts.height <= 0) {
+        std::cerr << "--size must look like 80x40\n";
+        std::exit(1);
+      }
+    } else if (arg == "--output" && i + 1 < argc) {
+      opts.output = argv[++i];
+    } else if (arg == "--metrics-port" && i + 1 < argc) {
+      opts.metrics_port = std::atoi(argv[++i]);
+    } else if (arg == "--profile" && i + 1 < argc) {
+      opts.profile = argv[++i];
+    } else if (arg == "--scene" && i + 1 < argc) {
+      opts.scene = argv[++i];
+    } else if (arg == "--scene-file" && i + 1 < argc) {
+      opts.scene_file = argv[++i];
+    } else if (arg == "--bvh-cache" && i + 1 < argc) {
+      opts.bvh_cache = argv[++i];
+    } else if (arg == "--still" && i + 1 < argc) {
+      opts.still = argv[++i];
+    } else if (arg == "--frames" && i + 1 < argc) {
+      opts.frames = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "--views" && i + 1 < argc) {
+      opts.views = argv[++i];
+    } else if (arg == "--pipe") {
+      opts.pipe = true;
+    } else if (arg == "--serve" && i + 1 < argc) {
+      opts.serve_port = std::atoi(argv[++i]);
+    } else if (arg == "--query" && i + 1 < argc) {
+      opts.query = argv[++i];
+      if (opts.query != "nearest" && opts.query != "occluded") {
+        std::cerr << "--query must be nearest or occluded\n";
+        std::exit(1);
+      }
+    } else {
+      fprintf(stderr, usage, argv[0]);
+      std::exit(1);
+    }
+  }
+  return opts;
+}
+
+int main(int argc, char** argv) {
+  const Options opts = parse_options(argc, argv);
+  const bool bench = opts.bench_frames > 0;
+  bvh_cache.dir = opts.bvh_cache;
+  if (!opts.views.empty() && !parse_views(opts.views)) {
+    std::cerr << "--views takes up to 4 of main, top and side\n";
+    return 1;
+  }
+  if (!opts.profile.empty()) {
+    profiler.start(opts.profile);
+    std::atexit([] { profiler.write_folded(); });
+  }
+  if (opts.scene.empty()) {
+    scene = default_scene();
+  } else {
+    if (!generate_scene(opts.scene, default_layout().lights, scene)) {
+      std::cerr << "unknown scene " << opts.scene << "\n";
+      return 1;
+    }
+    build_bvh(scene);
+  }
+  if (!opts.scene_file.empty()) {
+    std::string error;
+    if (!load_scene(opts.scene_file, scene, error)) {
+      std::cerr << error << "\n";
+      return 1;
+    }
+  }
+  const BvhCache::Build build = bvh_cache.last();
+  if (metrics.bvh_cache_hits)
+    fprintf(stderr, "BVH of %zu spheres loaded in %.3fs, %.3fs saved\n",
+            scene.bvh.size(), build.seconds, build.saved());
+  else if (metrics.bvh_cache_misses)
+    fprintf(stderr, "BVH of %zu spheres built in %.3fs%s\n",
+            scene.bvh.size(), build.seconds,
+            metrics.bvh_cache_errors ? ", not cached" : " and cached");
+  if (!opts.query.empty())
+    return answer_queries(opts.query == "occluded");
+  if (opts.bench_bvh)
+    return bench_bvh(opts.bench_bvh);
+  if (!opts.still.empty())
+    return render_still(opts.still, opts.width ? opts.width : 1920,
+                        opts.height ? opts.height : 1080, opts.frames);
+
+  const int width = opts.width ? opts.width : opts.sixel ? 320 : 80;
+  const int height = opts.height ? opts.height : opts.sixel ? 160 : 40;
+  if (opts.pipe) {
+    signal(SIGPIPE, SIG_IGN);
+    return Pipe().run(width, height);
+  }
+  if (opts.serve_port) {
+    signal(SIGPIPE, SIG_IGN);
+    return serve(opts.serve_port, width, height);
+  }
+
+  setlocale(LC_CTYPE, "");
+  if (bench) {
+    // Same output path, but the terminal is /dev/null or a file.
+    int fd = opts.output.empty() ? open("/dev/null", O_WRONLY)
+                                 : open(opts.output.c_str(),
+                                        O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(opts.output.c_str());
+      return 1;
+    }
+    output.open(fd);
+  } else {
+    // ncurses only sets up the terminal; frames bypass it.
+    initscr();
+    cbreak();
+    noecho();
+    curs_set(0);
+    clear();
+    refresh();
+    output.open(STDOUT_FILENO);
+  }
+  build_palette_lut();
+  build_sgr_table();
+  dither = opts.dither ? 1 / 6.f : 0;
+  sixel = opts.sixel;
+
+  std::thread input(bench ? simulate_input : read_input);
+  if (!opts.scene_file.empty())
+    scene_watcher.start(opts.scene_file, scene);
+  std::thread metrics_server;
+  if (opts.metrics_port)
+    metrics_server = std::thread(serve_metrics, opts.metrics_port);
+  Frame traced, next, interpolated;
+  Frame low; // traced at 1/--scale of the resolution, then upscaled
+  traced.resize(width, height);
+  next.resize(width, height);
+  const std::chrono::milliseconds frameDuration(1000 / 30);
+  const auto displayDuration =
+      opts.interpolate ? frameDuration / 2 : frameDuration;
+  auto pace = [&](Clock::time_point start) {
+    auto renderDuration =
+        std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() -
+                                                              start);
+    if (!bench && renderDuration < displayDuration) {
+      std::this_thread::sleep_for(displayDuration - renderDuration);
+    }
+  };
+  int frames = 0, cancelled = 0, steady_from = 3;
+  auto bench_start = Clock::now(), last_frame = bench_start;
+  char status[160] = "";
+  // Ends a frame that made it to the output, or with presented false, one
+  // that was dropped because the terminal was behind.
+  auto shown = [&](bool presented) {
+    FrameArena::reset_all();
+    if (!presented)
+      return;
+    // A couple of frames in, every buffer has reached its final size.
+    if (++frames == steady_from && opts.check_alloc)
+      forbid_allocations = true;
+    auto now = Clock::now();
+    float frame_seconds =
+        std::chrono::duration<float>(now - last_frame).count();
+    last_frame = now;
+    metrics.frames = frames;
+    metrics.cancelled = cancelled;
+    metrics.dropped = output.dropped;
+    metrics.frame_seconds = frame_seconds;
+    metrics.output_bytes = output.bytes_written;
+    metrics.output_pending = output.pending_bytes();
+    if (opts.stats) {
+      int n = snprintf(status, sizeof status, "%5.1f fps  ", 1 / frame_seconds);
+      n += snprintf(status + n, sizeof status - n,
+                    "dropped %zu  saved %zuKiB  ", output.dropped,
+                    output.bytes_saved >> 10);
+      latency.summary(status + n, sizeof status - n);
+    }
+  };
+  bool have_trace = false;
+  bool stepped = false; // the scene is at the time of the frame to trace
+  const Frame* on_screen = &traced;
+  while (running && (!bench || frames < opts.bench_frames)) {
+    auto start = Clock::now();
+    if (scene_watcher.apply(scene)) {
+      // Per-sphere buffers resize, and the last trace cannot be reprojected.
+      have_trace = false;
+      forbid_allocations = false;
+      steady_from = frames + 3;
+    }
+    // A cancelled frame is traced again for the same time, so input does
+    // not speed up the animation.
+    if (!stepped && opts.interpolate && have_trace) {
+      // Advance half a frame, show the reprojection of the last trace, then
+      // finish the step and trace for real.
+      animate(0.5f);
+      sync_camera(interpolated);
+      reproject(traced, interpolated);
+      const bool presented = present(interpolated, status);
+      if (presented)
+        on_screen = &interpolated;
+      shown(presented);
+      pace(start);
+      start = Clock::now();
+      animate(0.5f);
+    } else if (!stepped) {
+      animate();
+    }
+    stepped = true;
+    sync_camera(next);
+    Rendered rendered = render(next, low, *on_screen, status, opts.scale);
+    if (rendered == Rendered::cancelled || rendered == Rendered::partial) {
+      cancelled++;
+      if (rendered == Rendered::partial) {
+        on_screen = &next;
+        FrameArena::reset_all();
+      }
+      continue; // input arrived mid-frame, start over with the new camera
+    }
+    stepped = false;
+    std::swap(traced, next);
+    have_trace = true;
+    if (rendered == Rendered::shown || on_screen == &next)
+      on_screen = &traced; // if dropped, the closest to what is shown
+    shown(rendered == Rendered::shown);
+    pace(start);
+  }
+  forbid_allocations = false;
+  running = false;
+  input.join();
+  scene_watcher.join();
+  if (metrics_server.joinable())
+    metrics_server.join();
+  output.close();
+  if (!bench)
+    endwin();
+  if (output.error) {
+    fprintf(stderr, "writing frames: %s\n", strerror(output.error));
+    return 1;
+  }
+  if (bench) {
+    float seconds = std::chrono::duration<float>(Clock::now() - bench_start)
+                        .count();
+    local_counters().publish();
+    const uint64_t rays = total(&ThreadCounters::rays);
+    printf("scene %s: %zu spheres, %zu lights\n",
+           !opts.scene_file.empty() ? opts.scene_file.c_str()
+           : opts.scene.empty()     ? "default"
+                                    : opts.scene.c_str(),
+           scene.bvh.size(), scene.lights.size());
+    printf("%d frames in %.2fs (%.1f fps), %d cancelled, %.3g rays/s\n",
+           frames, seconds, frames / seconds, cancelled, rays / seconds);
+    if (latency.events()) { // none when the run ends before a key press
+      latency.summary(status, sizeof status);
+      printf("%s over %zu input events\n", status, latency.events());
     }
+    printf("%zu bytes written, %zu saved by diffing, %zu frames dropped\n",
+           output.bytes_written, output.bytes_saved, output.dropped);
   }
-  endwin();
   return 0;
 }
@@ -0,0 +1,69 @@
+// Answers the same rays as nearest hit and as occlusion queries and checks
+// that both agree on whether anything lies before tmax, including hits far
+// beyond the range that counts for rendering.
+#define main ascii_raytracer_main
+#include "../ascii-raytracer.cpp"
+#undef main
+
+#include <cstdio>
+
+namespace {
+
+bool check(const char* name, const std::vector<vec3>& origins,
+           const std::vector<vec3>& dirs, const std::vector<float>& tmax) {
+  const size_t n = origins.size();
+  std::vector<RayHit> hits(n);
+  std::vector<uint8_t> occluded(n);
+  intersect_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                  hits.data());
+  occluded_batch(scene, n, origins.data(), dirs.data(), tmax.data(),
+                 occluded.data());
+  size_t hit_count = 0;
+  for (size_t i = 0; i < n; i++) {
+    const bool hit = hits[i].object != background;
+    hit_count += hit;
+    if (hit != bool(occluded[i]) || (hit && !(hits[i].t < tmax[i]))) {
+      printf("%s: ray %zu is %s by nearest hit (t %g) but %s by occlusion\n",
+             name, i, hit ? "hit" : "missed", hits[i].t,
+             occluded[i] ? "blocked" : "clear");
+      return false;
+    }
+  }
+  printf("%s: ok, %zu of %zu rays hit\n", name, hit_count, n);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  scene = default_scene();
+  bool ok = true;
+
+  // Far away along -z, towards the default spheres.
+  ok &= check("far", {{0, 0, 2000}}, {{0, 0, -1}}, {5000});
+
+  if (!generate_scene("random:3000", default_layout().lights, scene)) {
+    printf("no random scene\n");
+    return 1;
+  }
+  build_bvh(scene);
+  std::mt19937 rng(7);
+  auto uniform = [&](float lo, float hi) {
+    return lo + (hi - lo) * ((rng() >> 8) * (1.f / (1 << 24)));
+  };
+  std::vector<vec3> origins, dirs;
+  std::vector<float> tmax;
+  for (int i = 0; i < 20000; i++) {
+    vec3 d = {uniform(-1, 1), uniform(-1, 1), uniform(-1, 1)};
+    if (!(d.norm() > .01f))
+      continue;
+    // Some origins far outside the scene, with limits short and long.
+    const float reach = i % 4 ? 20 : 3000;
+    origins.push_back({uniform(-reach, reach), uniform(-reach, reach),
+                       uniform(-reach, reach) - 25});
+    dirs.push_back(d.normalized());
+    tmax.push_back(uniform(0, 2 * reach));
+  }
+  ok &= check("random", origins, dirs, tmax);
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,176 @@
+// Runs the render server in process, has a client render a frame over its
+// socket, then stops the server with SIGTERM while that client and an idle
+// one are still connected. The server has to end both sessions and return;
+// an alarm fails the test if it hangs instead.
+//
+// Before that, a light session renders frame after frame while a heavy one
+// traces a single large frame on the same scheduler. The light one has to
+// keep getting frames, with its tiles queued no longer than a few quanta.
+#define main ascii_raytracer_main
+#include "../ascii-raytracer.cpp"
+#undef main
+
+#include <cstdio>
+
+namespace {
+
+// A port nobody listens on right now.
+int free_port() {
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t size = sizeof addr;
+  bind(s, reinterpret_cast<sockaddr*>(&addr), size);
+  getsockname(s, reinterpret_cast<sockaddr*>(&addr), &size);
+  close(s);
+  return ntohs(addr.sin_port);
+}
+
+// Connects to the server, retrying while it starts up.
+int connect_to(int port) {
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof addr) == 0)
+      return s;
+    close(s);
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  return -1;
+}
+
+bool read_all(int s, void* data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(s, static_cast<char*>(data) + done, size - done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+bool fail(const char* what) {
+  printf("%s\n", what);
+  return false;
+}
+
+bool send(int s, const char* commands) {
+  const ssize_t size = strlen(commands);
+  return write(s, commands, size) == size;
+}
+
+// Reads a frame and returns its size in pixels, or 0 on a bad frame.
+size_t read_frame(int s) {
+  uint8_t header[16];
+  if (!read_all(s, header, sizeof header) || memcmp(header, "ARTF", 4))
+    return 0;
+  uint32_t size[3];
+  for (int i = 0; i < 12; i++)
+    reinterpret_cast<uint8_t*>(size)[i] = header[4 + i];
+  std::vector<uint8_t> rgb(3 * size[0] * size[1]);
+  return read_all(s, rgb.data(), rgb.size()) ? size[0] * size[1] : 0;
+}
+
+// Sessions as the server runs them, on socket pairs instead of connections.
+bool fairness() {
+  int threads = 1;
+#ifdef _OPENMP
+  threads = omp_get_max_threads();
+#endif
+  TileScheduler scheduler;
+  scheduler.start(threads);
+  int heavy[2], light[2];
+  socketpair(AF_UNIX, SOCK_STREAM, 0, heavy);
+  socketpair(AF_UNIX, SOCK_STREAM, 0, light);
+  Pipe heavy_pipe(heavy[1], heavy[1], &scheduler);
+  Pipe light_pipe(light[1], light[1], &scheduler);
+  heavy_pipe.queue.id = 1;
+  light_pipe.queue.id = 2;
+  std::thread heavy_session([&] { heavy_pipe.run(16, 8); });
+  std::thread light_session([&] { light_pipe.run(16, 8); });
+
+  // Seconds of tracing on one worker; the light frames take milliseconds.
+  if (!send(heavy[0], "scene random:100000\nsize 160 120\nrender\nquit\n"))
+    return fail("could not send commands");
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  const int light_frames = 20;
+  for (int i = 0; i < light_frames; i++)
+    if (!send(light[0], "size 32 16\nrender\n") || !read_frame(light[0]))
+      return fail("light session stopped getting frames");
+  pollfd pfd{heavy[0], POLLIN, 0};
+  const bool overlapped = poll(&pfd, 1, 0) == 0;
+  if (!send(light[0], "quit\n") || read_frame(heavy[0]) != 160 * 120)
+    return fail("no heavy frame");
+  heavy_session.join();
+  light_session.join();
+  scheduler.stop();
+  for (int s : {heavy[0], heavy[1], light[0], light[1]})
+    close(s);
+
+  const TileScheduler::Queue &h = heavy_pipe.queue, &l = light_pipe.queue;
+  printf("fairness: light %lu frames, tile queue time %.2fms mean, %.2fms "
+         "max; heavy %lu frame, %.2fs traced\n",
+         (unsigned long)l.frames, l.queue_ns / l.tiles * 1e-6,
+         l.max_queue_ns * 1e-6, (unsigned long)h.frames, h.busy_ns * 1e-9);
+  if (!overlapped)
+    return fail("the heavy frame was done before the light ones");
+  if (l.frames != light_frames)
+    return fail("light frames missing");
+  // A heavy tile takes a few ms here. Light tiles wait for the ones in
+  // flight and about a quantum more, not for the heavy frame's seconds; the
+  // rest is slack for a loaded machine.
+  if (l.max_queue_ns > 50e6)
+    return fail("light tiles queued too long");
+  return true;
+}
+
+bool run() {
+  const int port = free_port();
+  int result = -1;
+  std::thread server([&] { result = serve(port, 16, 8); });
+  int active = connect_to(port);
+  int idle = connect_to(port);
+  if (active < 0 || idle < 0)
+    return fail("could not connect");
+
+  const char commands[] = "size 24 12\nrender\n";
+  if (write(active, commands, sizeof commands - 1) != sizeof commands - 1)
+    return fail("could not send commands");
+  uint8_t header[16];
+  if (!read_all(active, header, sizeof header) || memcmp(header, "ARTF", 4))
+    return fail("no frame header");
+  uint32_t size[3];
+  for (int i = 0; i < 12; i++)
+    reinterpret_cast<uint8_t*>(size)[i] = header[4 + i];
+  if (size[0] != 24 || size[1] != 12 || size[2] != 1)
+    return fail("wrong frame size or render count");
+  std::vector<uint8_t> rgb(3 * 24 * 12);
+  if (!read_all(active, rgb.data(), rgb.size()))
+    return fail("short frame");
+  printf("frame: ok\n");
+
+  kill(getpid(), SIGTERM);
+  server.join();
+  if (result != 0)
+    return fail("server failed");
+  char c;
+  if (read(active, &c, 1) != 0 || read(idle, &c, 1) != 0)
+    return fail("sessions still open after the server stopped");
+  close(active);
+  close(idle);
+  printf("shutdown: ok\n");
+  return true;
+}
+
+} // namespace
+
+int main() {
+  alarm(30);
+  build_palette_lut();
+  scene = default_scene();
+  return fairness() && run() ? 0 : 1;
+}
@@ -0,0 +1,157 @@
+// Encodes known frames with the Sixel backend, decodes the stream again and
+// checks that every pixel comes back as the palette index it was quantized
+// to. The renderer is one translation unit, so it is included here with its
+// main renamed.
+#define main ascii_raytracer_main
+#include "../ascii-raytracer.cpp"
+#undef main
+
+#include <cstdio>
+
+namespace {
+
+// A decoded image: palette indices, -1 where nothing was drawn.
+struct Image {
+  int width = 0, height = 0;
+  std::vector<int> index;
+  bool defined[256] = {};
+};
+
+// Decodes the subset of Sixel the encoder writes: the raster attributes,
+// color definitions and selections, repeats, "$" and "-".
+bool decode(const std::string& in, Image& image, std::string& error) {
+  size_t i = in.find('q');
+  if (in.compare(0, 2, "\x1bP") || i == std::string::npos) {
+    error = "no DCS introducer";
+    return false;
+  }
+  i++;
+  auto number = [&] {
+    int n = 0;
+    while (i < in.size() && isdigit(in[i]))
+      n = n * 10 + (in[i++] - '0');
+    return n;
+  };
+  int color = -1, x = 0, y = 0;
+  while (i < in.size()) {
+    char c = in[i++];
+    if (c == '"') {
+      int params[4];
+      for (int k = 0; k < 4; k++) {
+        params[k] = number();
+        if (k < 3 && in[i++] != ';') {
+          error = "bad raster attributes";
+          return false;
+        }
+      }
+      image.width = params[2];
+      image.height = params[3];
+      image.index.assign(image.width * image.height, -1);
+    } else if (c == '#') {
+      color = number();
+      if (in[i] == ';') { // a definition, not a selection
+        i += 3;             // ";2;", the RGB color space
+        for (int k = 0; k < 3; k++) {
+          number();
+          if (k < 2)
+            i++;
+        }
+        if (color < 0 || color > 255) {
+          error = "register out of range";
+          return false;
+        }
+        image.defined[color] = true;
+      } else if (color < 0 || color > 255 || !image.defined[color]) {
+        error = "selected undefined register " + std::to_string(color);
+        return false;
+      }
+    } else if (c == '!' || (c >= '?' && c <= '~')) {
+      int run = 1;
+      if (c == '!') {
+        run = number();
+        c = in[i++];
+      }
+      for (int k = 0; k < run; k++, x++)
+        for (int r = 0; r < 6; r++) {
+          if (!((c - '?') >> r & 1))
+            continue;
+          if (x >= image.width || y + r >= image.height) {
+            error = "pixel outside the raster";
+            return false;
+          }
+          image.index[(y + r) * image.width + x] = color;
+        }
+    } else if (c == '$') {
+      x = 0;
+    } else if (c == '-') {
+      x = 0;
+      y += 6;
+    } else if (c == '\x1b' && in.compare(i, 1, "\\") == 0) {
+      return true;
+    } else {
+      error = std::string("unexpected character ") + c;
+      return false;
+    }
+  }
+  error = "no string terminator";
+  return false;
+}
+
+// Runs the encoder of present_sixel on frame and returns its output.
+std::string encode(const Frame& frame) {
+  std::string out = sixel_header(frame.width, frame.height);
+  for (int band = 0; band < (frame.height + 5) / 6; band++) {
+    iovec span = encode_sixel_band(frame, band);
+    out.append(static_cast<char*>(span.iov_base), span.iov_len);
+  }
+  out += "\x1b\\";
+  FrameArena::reset_all();
+  return out;
+}
+
+bool check(const char* name, int width, int height,
+           vec3 (*color)(int x, int y)) {
+  Frame frame;
+  frame.resize(width, height);
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++)
+      frame.color[y * width + x] = color(x, y);
+  Image image;
+  std::string error;
+  if (!decode(encode(frame), image, error)) {
+    printf("%s: %s\n", name, error.c_str());
+    return false;
+  }
+  if (image.width != width || image.height != height) {
+    printf("%s: raster is %dx%d, not %dx%d\n", name, image.width,
+           image.height, width, height);
+    return false;
+  }
+  for (int y = 0; y < height; y++)
+    for (int x = 0; x < width; x++) {
+      int expected = quantize(frame.color[y * width + x], x, y);
+      int got = image.index[y * width + x];
+      if (got != expected) {
+        printf("%s: pixel %d,%d is %d, not %d\n", name, x, y, got, expected);
+        return false;
+      }
+    }
+  printf("%s: ok\n", name);
+  return true;
+}
+
+} // namespace
+
+int main() {
+  build_palette_lut();
+  bool ok = true;
+  // Every palette color, in bands cut short by the height.
+  ok &= check("palette", 37, 13, [](int x, int y) {
+    return xterm_color(16 + (x * 7 + y * 13) % 240) * (1.f / 255);
+  });
+  // Runs longer than 99999 pixels need six digits.
+  ok &= check("long runs", 100003, 7, [](int x, int y) {
+    return x < 100001 ? vec3{1, 0, 0} : vec3{0, 0, float(x % 2)};
+  });
+  return ok ? 0 : 1;
+}